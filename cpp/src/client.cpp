@@ -10,8 +10,14 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/use_awaitable.hpp>
 #include <vector>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <future>
 #include "config.h"
 #include "cmds.h"
 #include "engine.h"
@@ -20,16 +26,30 @@
 #include "input.h"
 #include "packets.h"
 #include "events.h"
+#include "recvbuffer.h"
+#include "jitterbuffer.h"
+#include "spscqueue.h"
 
 using namespace std;
 using namespace boost::asio::ip;
+using boost::asio::awaitable;
+using boost::asio::use_awaitable;
 
 Game game;
 
 UI ui;
 
-vector<FrameEventsPacket> receivedFrameCmdsPackets;
+// main thread only; the network thread hands these over through ConnectionHandler::takeReceived
+JitterBuffer<FrameEventsPacket> receivedFrameCmdsPackets;
 vector<Game> receivedResyncs;
+vector<GameDelta> receivedDeltaResyncs;
+bool receivedCatchUp = false; // the server's replaying the frames we missed instead of resyncing us
+string resumptionToken; // from the server's last handshake, to reconnect with instead of signing again
+
+// how fast to play frames back; the server slows down from ONE_FRAME when it's overloaded, and says so
+chrono::duration<double> frameInterval = ONE_FRAME;
+// how many frames ahead of the server's game it sends them; that's how many we should have in hand
+unsigned int inputDelay = 0;
 
 void clearVchAndBuildCmdPacket(vch *dest, boost::shared_ptr<Cmd> cmd)
 {
@@ -39,25 +59,153 @@ void clearVchAndBuildCmdPacket(vch *dest, boost::shared_ptr<Cmd> cmd)
     cmd->pack(dest);
 
     vch prepended;
-    packToVch(&prepended, "H", (uint16_t)(dest->size()));
+    VchWriter(&prepended).put<uint16_t>(dest->size());
 
     dest->insert(dest->begin(), prepended.begin(), prepended.end());
 }
 
+// Once the handshake's done, everything on the socket happens on the network thread, packets get decoded there
+// too, and the main loop only hears about it through lock-free queues: decoded frames and resyncs one way
+// (takeReceived), cmds the other (queueCmd). So a slow display never holds up reading from the server, and
+// decoding a big resync never holds up the display. A reconnect stops the network thread and does the handshake
+// on the main thread, as at startup.
 class ConnectionHandler
 {
-    vch receivedBytes;
+    ReceiveBuffer receiveBuffer;
+    vch decompressedBytes; // kept around so its capacity is reused
+    ResyncAssembler resyncAssembler;
     boost::asio::io_service &ioService;
+    boost::asio::io_service::work keepRunning; // so the network thread doesn't run out of work between connections
     tcp::socket &socket;
+    thread networkThread;
 
     vector<vch *> packetsToSend;
     bool sending;
 
+    uint64_t baselineFrame; // what we told the server we're at
+
+    // network thread to main thread
+    SpscQueue<FrameEventsPacket> framesReceived;
+    SpscQueue<Game, 4> resyncsReceived;
+    SpscQueue<GameDelta, 4> deltaResyncsReceived;
+    atomic<uint64_t> tickIntervalMicrosReceived; // 0 if it hasn't changed since the last takeReceived
+    atomic<unsigned int> inputDelayReceived;
+    atomic<bool> catchUpReceived;
+
+    // main thread to network thread; sendPosted is set while there's a sendQueuedCmds on its way
+    SpscQueue<boost::shared_ptr<Cmd>> cmdsToSend;
+    atomic<bool> sendPosted;
+
+    void handleError(const boost::system::error_code &error, string context)
+    {
+        // a reconnect closes the socket out from under any outstanding reads and writes
+        if (error == boost::asio::error::operation_aborted)
+            return;
+
+        cout << context << ": " << error.message() << endl;
+        connectionLost = true;
+    }
+
+    // Whatever's in our game can't be trusted to line up with the server's anymore, so start over
+    // with a fresh connection and resync.
+    void handleMalformedPacket(string packetName, const VchReader &reader)
+    {
+        cout << "Received a malformed " << packetName << " packet (" << (reader.ok() ? "trailing bytes" : reader.getErrorString()) << ")" << endl;
+        connectionLost = true;
+    }
+
 public:
+    atomic<bool> connectionLost;
     ConnectionHandler(boost::asio::io_service &ioService, tcp::socket &socket)
-        : ioService(ioService), socket(socket)
+        : receiveBuffer(SOCKET_READ_SIZE), ioService(ioService), keepRunning(ioService), socket(socket)
+    {
+        sending = false;
+        baselineFrame = 0;
+        tickIntervalMicrosReceived = 0;
+        inputDelayReceived = 0;
+        catchUpReceived = false;
+        sendPosted = false;
+        connectionLost = false;
+    }
+    // Drops anything queued for the old connection; call after the socket's been closed and reconnected, with the
+    // network thread stopped.
+    void reset()
     {
+        for (uint i=0; i < packetsToSend.size(); i++)
+        {
+            delete packetsToSend[i];
+        }
+        packetsToSend.clear();
         sending = false;
+        resyncAssembler = ResyncAssembler();
+
+        FrameEventsPacket frame(0, {}, {});
+        while (framesReceived.pop(&frame)) {}
+        Game resync;
+        while (resyncsReceived.pop(&resync)) {}
+        GameDelta delta;
+        while (deltaResyncsReceived.pop(&delta)) {}
+        tickIntervalMicrosReceived = 0;
+        catchUpReceived = false;
+        boost::shared_ptr<Cmd> cmd;
+        while (cmdsToSend.pop(&cmd)) {}
+        sendPosted = false;
+
+        connectionLost = false;
+    }
+
+    // Main thread, once the receiving loop's started.
+    void startNetworkThread()
+    {
+        networkThread = thread([this] { ioService.run(); });
+    }
+    // Main thread. Anything already handed to the network thread, cmds included, is dealt with first.
+    void stopNetworkThread()
+    {
+        promise<void> caughtUp;
+        boost::asio::post(ioService, [&caughtUp] { caughtUp.set_value(); });
+        caughtUp.get_future().wait();
+
+        ioService.stop();
+        networkThread.join();
+        ioService.restart();
+    }
+    // Main thread, with the network thread stopped. Blocks until every queued cmd's been written, or the
+    // connection's lost.
+    void finishSending()
+    {
+        sendQueuedCmds();
+        while (!connectionLost && (sending || packetsToSend.size() > 0))
+        {
+            ioService.run_one();
+        }
+    }
+
+    // Main thread. Takes everything the network thread's decoded since the last call.
+    void takeReceived()
+    {
+        FrameEventsPacket frame(0, {}, {});
+        while (framesReceived.pop(&frame))
+        {
+            receivedFrameCmdsPackets.push(std::move(frame));
+        }
+        Game resync;
+        while (resyncsReceived.pop(&resync))
+        {
+            receivedResyncs.push_back(std::move(resync));
+        }
+        GameDelta delta;
+        while (deltaResyncsReceived.pop(&delta))
+        {
+            receivedDeltaResyncs.push_back(std::move(delta));
+        }
+
+        uint64_t tickIntervalMicros = tickIntervalMicrosReceived.exchange(0);
+        if (tickIntervalMicros != 0)
+            frameInterval = chrono::microseconds(tickIntervalMicros);
+        inputDelay = inputDelayReceived;
+        if (catchUpReceived.exchange(false))
+            receivedCatchUp = true;
     }
     string receiveSigChallenge()
     {
@@ -75,111 +223,278 @@ public:
         boost::asio::read(socket, buf);
         return string(boost::asio::buffer_cast<const char*>(buf.data()), buf.size());
     }
+    string receiveResumptionToken()
+    {
+        boost::asio::streambuf buf(256);
+        size_t size = boost::asio::read_until(socket, buf, '\n');
+        // leave out the trailing \n
+        return string(boost::asio::buffer_cast<const char*>(buf.data()), size - 1);
+    }
+    // 0 if we have no game yet; otherwise the server can send us a delta against this frame
+    void sendBaselineFrame(uint64_t baselineFrame)
+    {
+        this->baselineFrame = baselineFrame;
+
+        vch baselineBytes;
+        VchWriter(&baselineBytes).put<uint64_t>(baselineFrame);
+        boost::asio::write(socket, boost::asio::buffer(baselineBytes));
+    }
     void startReceivingLoop()
     {
-        clearVchAndReceiveNextPacket();
+        boost::asio::co_spawn(ioService, receivePackets(), boost::asio::detached);
     }
 
-    void clearVchAndReceiveNextPacket()
+    // Runs until the connection's lost (or closed for a reconnect).
+    awaitable<void> receivePackets()
     {
-        receivedBytes = vch(9);
+        receiveBuffer.clear();
+
+        try
+        {
+            size_t bytesStillNeeded = 0;
+            while (true)
+            {
+                size_t received = co_await socket.async_read_some(receiveBuffer.prepare(bytesStillNeeded), use_awaitable);
+                receiveBuffer.commit(received);
 
-        async_read(socket,
-                   boost::asio::buffer(receivedBytes),
-                   boost::bind(&ConnectionHandler::typecharAndSizeReceived,
-                               this,
-                               boost::asio::placeholders::error,
-                               boost::asio::placeholders::bytes_transferred));
+                if (!handleReceivedPackets(&bytesStillNeeded))
+                    co_return;
+            }
+        }
+        catch (boost::system::system_error &e)
+        {
+            handleError(e.code(), "Error receiving from server");
+        }
     }
-    void typecharAndSizeReceived(const boost::system::error_code &error, size_t received)
+    // Handles every whole packet we've got, and says how much more of the next one we need if it's partway in.
+    // Returns false if the connection's been marked lost.
+    bool handleReceivedPackets(size_t *bytesStillNeeded)
     {
-        if (!error)
+        *bytesStillNeeded = 0;
+        while (receiveBuffer.size() >= 9)
         {
-            vchIter place = receivedBytes.begin();
+            VchReader headerReader(receiveBuffer.data(), 9);
+            unsigned char packetTypechar = headerReader.get<uint8_t>();
+            uint64_t size = headerReader.get<uint64_t>();
 
-            unsigned char packetTypechar;
-            uint64_t size;
-            unpackFromIter(place, "CQ", &packetTypechar, &size);
-
-            switch (packetTypechar)
+            if (size > MAX_DECOMPRESSED_PACKET_SIZE)
+            {
+                // no way to know where the next packet starts
+                cout << "Received a packet claiming to be " << size << " bytes" << endl;
+                connectionLost = true;
+                return false;
+            }
+            if (receiveBuffer.size() < 9 + size)
             {
-            case PACKET_RESYNC_CHAR:
-                clearVchAndReceiveResyncPacket(size);
+                *bytesStillNeeded = 9 + size - receiveBuffer.size();
                 break;
+            }
 
-            case PACKET_FRAMECMDS_CHAR:
-                clearVchAndReceiveFrameCmdsPacket(size);
-                break;
+            bool handled = handlePacket(packetTypechar, receiveBuffer.data() + 9, size);
+            receiveBuffer.consume(9 + size);
+            if (!handled)
+                return false;
+        }
+        return true;
+    }
+
+    // Returns false if the packet was malformed, in which case the connection's been marked lost.
+    bool handlePacket(unsigned char packetTypechar, const unsigned char *body, size_t size)
+    {
+        if (packetTypechar & PACKET_COMPRESSED_FLAG)
+        {
+            packetTypechar &= ~PACKET_COMPRESSED_FLAG;
+            if (!decompressPacketBody(body, size, &decompressedBytes))
+            {
+                cout << "Received a compressed packet that doesn't decompress" << endl;
+                connectionLost = true;
+                return false;
             }
+            body = decompressedBytes.data();
+            size = decompressedBytes.size();
         }
-        else
+
+        VchReader reader(body, size);
+
+        switch (packetTypechar)
+        {
+        case PACKET_RESYNC_CHAR:
+            return handleResyncPacket(&reader);
+
+        case PACKET_FRAMECMDS_CHAR:
+            return handleFrameCmdsPacket(&reader);
+
+        case PACKET_DELTARESYNC_CHAR:
+            return handleDeltaResyncPacket(&reader);
+
+        case PACKET_FRAMEBATCH_CHAR:
+            return handleFrameBatchPacket(&reader);
+
+        case PACKET_RESYNCCHUNK_CHAR:
+            return handleResyncChunkPacket(&reader);
+        case PACKET_TICKINTERVAL_CHAR:
+            return handleTickIntervalPacket(&reader);
+        case PACKET_INPUTDELAY_CHAR:
+            return handleInputDelayPacket(&reader);
+
+        case PACKET_CATCHUP_CHAR:
+            return handleCatchUpPacket(&reader);
+
+        default:
+            cout << "Received a packet with an unrecognized typechar (" << (int)packetTypechar << ")" << endl;
+            connectionLost = true;
+            return false;
+        }
+    }
+    bool handleResyncPacket(VchReader *reader)
+    {
+        Game resync(reader);
+        if (!reader->ok() || !reader->atEnd())
         {
-            cout << error.message() << endl;
-            throw runtime_error("Error when receiving typechar");
+            handleMalformedPacket("resync", *reader);
+            return false;
         }
+        resyncsReceived.push(std::move(resync));
+
+        return true;
     }
-    void clearVchAndReceiveResyncPacket(uint64_t size)
+    bool handleDeltaResyncPacket(VchReader *reader)
     {
-        receivedBytes = vch(size);
+        GameDelta delta(reader);
+        if (!reader->ok() || !reader->atEnd())
+        {
+            handleMalformedPacket("delta resync", *reader);
+            return false;
+        }
+        deltaResyncsReceived.push(std::move(delta));
 
-        async_read(socket,
-                   boost::asio::buffer(receivedBytes),
-                   boost::bind(&ConnectionHandler::resyncPacketReceived,
-                               this,
-                               boost::asio::placeholders::error,
-                               boost::asio::placeholders::bytes_transferred));
+        return true;
     }
-    void clearVchAndReceiveFrameCmdsPacket(uint64_t size)
+    bool handleFrameCmdsPacket(VchReader *reader)
     {
-        receivedBytes = vch(size);
+        FrameEventsPacket fcp(reader);
+        if (!reader->ok() || !reader->atEnd())
+        {
+            handleMalformedPacket("frame", *reader);
+            return false;
+        }
+        framesReceived.push(std::move(fcp));
 
-        async_read(socket,
-                   boost::asio::buffer(receivedBytes),
-                   boost::bind(&ConnectionHandler::frameCmdsPacketReceived,
-                               this,
-                               boost::asio::placeholders::error,
-                               boost::asio::placeholders::bytes_transferred));
+        return true;
     }
-    void resyncPacketReceived(const boost::system::error_code &error, size_t received)
+    bool handleResyncChunkPacket(VchReader *reader)
     {
-        if (!error)
+        bool resyncComplete = resyncAssembler.receiveChunk(reader);
+        if (!reader->ok())
         {
-            vchIter place = receivedBytes.begin();
+            handleMalformedPacket("resync chunk", *reader);
+            return false;
+        }
 
-            // cout << "BYTES:" << endl;
-            // debugOutputVch(receivedBytes);
-            // cout << endl << ":FIN" << endl;
+        if (resyncComplete)
+        {
+            if (resyncAssembler.isDelta)
+                deltaResyncsReceived.push(std::move(resyncAssembler.delta));
+            else
+                resyncsReceived.push(std::move(resyncAssembler.game));
 
-            receivedResyncs.push_back(Game(&place));
+            resyncAssembler = ResyncAssembler();
+        }
 
-            clearVchAndReceiveNextPacket();
+        return true;
+    }
+    bool handleFrameBatchPacket(VchReader *reader)
+    {
+        // expands to one FrameEventsPacket per frame, same as if they'd come one at a time
+        vector<FrameEventsPacket> frames;
+        unpackFrameBatch(reader, &frames);
+        if (!reader->ok())
+        {
+            handleMalformedPacket("frame batch", *reader);
+            return false;
         }
-        else
+        for (unsigned int i = 0; i < frames.size(); i++)
         {
-            throw runtime_error("Error when receiving resync packet");
+            framesReceived.push(std::move(frames[i]));
         }
+
+        return true;
     }
-    void frameCmdsPacketReceived(const boost::system::error_code &error, size_t received)
+    bool handleTickIntervalPacket(VchReader *reader)
     {
-        if (error)
+        uint64_t micros = reader->getVarint();
+        // anything outside 1ms - 1s is nonsense
+        if (reader->ok() && (micros < 1000 || micros > 1000000))
+            reader->fail(VchReader::ValueTooBig);
+        if (!reader->ok() || !reader->atEnd())
         {
-            throw runtime_error("Error receiving frameCmds packet:" + error.value());
+            handleMalformedPacket("tick interval", *reader);
+            return false;
         }
-        else
+
+        tickIntervalMicrosReceived = micros;
+        cout << "Server's tick interval is now " << micros / 1000.0 << "ms" << endl;
+
+        return true;
+    }
+
+    bool handleInputDelayPacket(VchReader *reader)
+    {
+        uint64_t frames = reader->getVarint();
+        if (reader->ok() && frames > MAX_INPUT_DELAY)
+            reader->fail(VchReader::ValueTooBig);
+        if (!reader->ok() || !reader->atEnd())
         {
-            vchIter place = receivedBytes.begin();
+            handleMalformedPacket("input delay", *reader);
+            return false;
+        }
 
-            receivedFrameCmdsPackets.push_back(FrameEventsPacket(&place));
+        inputDelayReceived = frames;
+        cout << "Server's input delay is now " << frames << " frames" << endl;
 
-            clearVchAndReceiveNextPacket();
+        return true;
+    }
+
+    bool handleCatchUpPacket(VchReader *reader)
+    {
+        // the frame the replay starts at, which had better be the one we said we were at
+        uint64_t frame = reader->getVarint();
+        if (!reader->ok() || !reader->atEnd())
+        {
+            handleMalformedPacket("catch-up", *reader);
+            return false;
+        }
+        if (frame != baselineFrame)
+        {
+            cout << "Server's catching us up from frame " << frame << ", but we're at " << baselineFrame << endl;
+            connectionLost = true;
+            return false;
         }
+
+        catchUpReceived = true;
+
+        return true;
     }
 
-    void sendCmd(boost::shared_ptr<Cmd> cmd)
+    // Main thread.
+    void queueCmd(boost::shared_ptr<Cmd> cmd)
+    {
+        cmdsToSend.push(cmd);
+        if (!sendPosted.exchange(true))
+            boost::asio::post(ioService, boost::bind(&ConnectionHandler::sendQueuedCmds, this));
+    }
+    // Network thread.
+    void sendQueuedCmds()
     {
-        packetsToSend.push_back(new vch);
+        // cleared first, so a cmd queued while we're popping gets another post rather than being missed
+        sendPosted = false;
 
-        clearVchAndBuildCmdPacket(packetsToSend.back(), cmd);
+        boost::shared_ptr<Cmd> cmd;
+        while (cmdsToSend.pop(&cmd))
+        {
+            packetsToSend.push_back(new vch);
+            clearVchAndBuildCmdPacket(packetsToSend.back(), cmd);
+        }
 
         sendNextPacketIfNotBusy();
     }
@@ -202,7 +517,7 @@ public:
     {
         if (error)
         {
-            throw runtime_error("ConnectionHandler error sending packet:" + error.value());
+            handleError(error, "ConnectionHandler error sending packet");
         }
         else
         {
@@ -218,6 +533,196 @@ public:
     }
 };
 
+void connectSocket(tcp::socket &socket, string ipString)
+{
+    // this is "connecting" to INADDR_ANY, which is very weird, but translates (at least on linux) to
+    // "connect to the loopback network". This is why this works on local tests.
+    if (ipString == "l")
+        socket.connect(tcp::endpoint(tcp::v4(), 8473));
+    else
+        socket.connect(tcp::endpoint(boost::asio::ip::address::from_string(ipString), 8473));
+}
+
+// Returns the address the server authenticated us as. If we've got a resumption token from an earlier
+// handshake, that goes instead of a sig; if the server won't take it, it drops the connection.
+string doHandshake(ConnectionHandler *connectionHandler, uint64_t baselineFrame)
+{
+    string sigChallenge = connectionHandler->receiveSigChallenge();
+
+    if (resumptionToken != "")
+    {
+        connectionHandler->sendSignature("resume " + resumptionToken + "\n");
+    }
+    else
+    {
+        // respond to the sig challenge with the user's help
+        cout << "Sign this with the address you deposited to:" << endl << sigChallenge << endl;
+
+        string userResponse;
+        cout << "sig: ";
+        cin >> userResponse;
+
+        connectionHandler->sendSignature(userResponse + "\n");
+    }
+    string playerAddress = connectionHandler->receiveAddress();
+    resumptionToken = connectionHandler->receiveResumptionToken();
+
+    connectionHandler->sendBaselineFrame(baselineFrame);
+
+    return playerAddress;
+}
+
+// Blocks until the server's first resync (full or delta) arrives, and applies it. Or, after a reconnect, until
+// the server says it'll just replay the frames we missed instead.
+void waitForAndApplyFirstSync(ConnectionHandler *connectionHandler)
+{
+    while (!connectionHandler->connectionLost)
+    {
+        this_thread::sleep_for(chrono::milliseconds(1));
+        connectionHandler->takeReceived();
+
+        if (receivedCatchUp)
+        {
+            receivedCatchUp = false;
+            break;
+        }
+
+        if (receivedResyncs.size() > 0)
+        {
+            game = receivedResyncs[0];
+            game.reassignEntityGamePointers();
+
+            receivedResyncs.erase(receivedResyncs.begin());
+            break;
+        }
+        if (receivedDeltaResyncs.size() > 0)
+        {
+            game.applyDelta(receivedDeltaResyncs[0]);
+
+            receivedDeltaResyncs.erase(receivedDeltaResyncs.begin());
+            break;
+        }
+    }
+}
+
+// Reconnects and catches back up from where our game left off. If we weren't gone long, the server just
+// replays the frames we missed; otherwise it usually only needs to send what's changed since then.
+void reconnect(boost::asio::io_service &io_service, tcp::socket &socket, string ipString, ConnectionHandler *connectionHandler)
+{
+    cout << "Lost connection. Reconnecting..." << endl;
+
+    // the handshake's done here, so nothing else should be touching the socket
+    connectionHandler->stopNetworkThread();
+
+    boost::system::error_code ignored;
+    socket.close(ignored);
+    io_service.poll(); // let aborted handlers run before the queues are dropped
+
+    connectSocket(socket, ipString);
+    connectionHandler->reset();
+
+    receivedFrameCmdsPackets.clear();
+    receivedResyncs.clear();
+    receivedDeltaResyncs.clear();
+    receivedCatchUp = false;
+    frameInterval = ONE_FRAME; // the server tells us again if it's still slowed down
+
+    try
+    {
+        doHandshake(connectionHandler, game.frame);
+    }
+    catch (boost::system::system_error &e)
+    {
+        if (resumptionToken == "")
+            throw;
+
+        // probably expired, or the server's restarted since; sign in again
+        cout << "Server wouldn't resume our session (" << e.code().message() << "). Reconnecting..." << endl;
+        resumptionToken = "";
+        socket.close(ignored);
+        connectSocket(socket, ipString);
+        doHandshake(connectionHandler, game.frame);
+    }
+    connectionHandler->startReceivingLoop();
+    connectionHandler->startNetworkThread();
+
+    waitForAndApplyFirstSync(connectionHandler);
+}
+
+// Puts in whatever resync goes before the next frame, and says whether we've got that frame to run.
+bool readyForNextFrame()
+{
+    if (receivedFrameCmdsPackets.empty())
+        return false;
+
+    // A full resync replaces the game outright, so it goes in right before its frame. A delta has to wait
+    // until we've caught up to its baseline.
+    if (receivedResyncs.size() > 0 && receivedResyncs[0].frame == receivedFrameCmdsPackets.front().frame)
+    {
+        game = receivedResyncs[0];
+        game.reassignEntityGamePointers();
+
+        receivedResyncs.erase(receivedResyncs.begin());
+    }
+    if (receivedDeltaResyncs.size() > 0 && receivedDeltaResyncs[0].baselineFrame == game.frame)
+    {
+        game.applyDelta(receivedDeltaResyncs[0]);
+
+        receivedDeltaResyncs.erase(receivedDeltaResyncs.begin());
+    }
+
+    // If we fell too far behind, the server dropped frames it had queued for us and sent a resync instead,
+    // so the frames skip ahead; hold off until the resync's in.
+    return receivedFrameCmdsPackets.front().frame == game.frame;
+}
+
+// Only once readyForNextFrame. Returns whether the frame started the game (a HoneypotAddedEvent).
+bool runNextFrame()
+{
+    FrameEventsPacket &fcp = receivedFrameCmdsPackets.front();
+    bool gameStarted = false;
+
+    // go through events
+    for (unsigned int i = 0; i < fcp.events.size(); i++)
+    {
+        fcp.events[i]->execute(&game);
+
+        if (boost::dynamic_pointer_cast<HoneypotAddedEvent, Event>(fcp.events[i]))
+            gameStarted = true;
+    }
+    
+    // go through cmds
+    for (unsigned int i = 0; i < fcp.authdCmds.size(); i++)
+    {
+        auto cmd = fcp.authdCmds[i]->cmd;
+        if (auto unitCmd = boost::dynamic_pointer_cast<UnitCmd, Cmd>(cmd))
+        {
+            unitCmd->executeAsPlayer(&game, fcp.authdCmds[i]->playerId);
+        }
+        else if (auto spawnBeaconCmd = boost::dynamic_pointer_cast<SpawnBeaconCmd, Cmd>(cmd))
+        {
+            spawnBeaconCmd->executeAsPlayer(&game, fcp.authdCmds[i]->playerId);
+        }
+        else if (auto setControlGroupCmd = boost::dynamic_pointer_cast<SetControlGroupCmd, Cmd>(cmd))
+        {
+            setControlGroupCmd->executeAsPlayer(&game, fcp.authdCmds[i]->playerId);
+        }
+        else if (auto withdrawCmd = boost::dynamic_pointer_cast<WithdrawCmd, Cmd>(cmd))
+        {
+            // ignore. Server processes withdrawals and creates an event.
+        }
+        else
+        {
+            cout << "Woah, I don't know how to handle that cmd as a client!" << endl;
+        }
+    }
+    receivedFrameCmdsPackets.pop();
+
+    game.iterate();
+
+    return gameStarted;
+}
+
 int main(int argc, char *argv[])
 {
     bool fullscreen = true;
@@ -236,12 +741,7 @@ int main(int argc, char *argv[])
     cin >> ipString;
 
     cout << "Connecting..." << endl;
-    // this is "connecting" to INADDR_ANY, which is very weird, but translates (at least on linux) to
-    // "connect to the loopback network". This is why this works on local tests.
-    if (ipString == "l")
-        socket.connect(tcp::endpoint(tcp::v4(), 8473));
-    else
-        socket.connect(tcp::endpoint(boost::asio::ip::address::from_string(ipString), 8473));
+    connectSocket(socket, ipString);
 
     // socket will now have its own local port.
 
@@ -251,36 +751,17 @@ int main(int argc, char *argv[])
 
     // HANDSHAKE
 
-    string playerAddress;
     int playerIdOrNegativeOne = -1;
 
-    // Wait for the sig challenge and respond with the user's help
-    string sigChallenge = connectionHandler.receiveSigChallenge();
-    cout << "Sign this with the address you deposited to:" << endl << sigChallenge << endl;
-    
-    string userResponse;
-    cout << "sig: ";
-    cin >> userResponse;
-
-    connectionHandler.sendSignature(userResponse + "\n");
-    playerAddress = connectionHandler.receiveAddress();
+    string playerAddress = doHandshake(&connectionHandler, 0);
 
     connectionHandler.startReceivingLoop();
+    connectionHandler.startNetworkThread();
 
     // Get the first resync packet
-    while (true)
-    {
-        io_service.poll();
-
-        if (receivedResyncs.size() > 0)
-        {
-            game = receivedResyncs[0];
-            game.reassignEntityGamePointers();
-
-            receivedResyncs.erase(receivedResyncs.begin());
-            break;
-        }
-    }
+    waitForAndApplyFirstSync(&connectionHandler);
+    if (connectionHandler.connectionLost)
+        throw runtime_error("Lost connection before the first resync");
 
     sf::RenderWindow* window = setupGraphics(fullscreen);
     
@@ -288,71 +769,69 @@ int main(int argc, char *argv[])
 
     ParticlesContainer particles;
 
+    ControlGroupCache controlGroupCache;
+
     chrono::time_point<chrono::system_clock, chrono::duration<double>> nextFrameStart(chrono::system_clock::now());
     while (window->isOpen())
     {
-        io_service.poll();
+        connectionHandler.takeReceived();
+
+        if (connectionHandler.connectionLost)
+        {
+            reconnect(io_service, socket, ipString, &connectionHandler);
+
+            // A SetControlGroupCmd that hadn't gone out yet was dropped with the rest of the queue, and a
+            // restarted server has no groups at all, so start the groups over. Our player index is looked up
+            // again too, in case it's a different game now.
+            controlGroupCache.clear();
+            playerIdOrNegativeOne = game.playerAddressToIdOrNegativeOne(playerAddress);
+            continue;
+        }
 
         chrono::time_point<chrono::system_clock, chrono::duration<double>> now(chrono::system_clock::now());
-        if (now < nextFrameStart || receivedFrameCmdsPackets.size() == 0)
+        if (now < nextFrameStart || !readyForNextFrame())
             continue;
-        
-        nextFrameStart += ONE_FRAME;
+
+        // More than a frame late (we stalled, or display was slow): pick the pace back up from now rather than
+        // rushing to make the time up. Getting back to real time is the jitter buffer's job.
+        if (now - nextFrameStart > frameInterval)
+            nextFrameStart = now;
+        nextFrameStart += frameInterval;
 
         vector<boost::shared_ptr<Cmd>> cmdsToSend = pollWindowEventsAndUpdateUI(&game, &ui, playerIdOrNegativeOne, window);
 
+        // groups only mean something once the server knows us as a player
+        if (playerIdOrNegativeOne < 0)
+            controlGroupCache.clear();
+
         for (uint i=0; i < cmdsToSend.size(); i++)
         {
-            cout << 1 << endl;
             if (!cmdsToSend[i])
+            {
                 cout << "Uh oh, I'm seeing some null cmds in cmdsToSend!" << endl;
-            else
-                connectionHandler.sendCmd(cmdsToSend[i]);
-        }
-        cmdsToSend.clear();
+                continue;
+            }
 
-        if (receivedResyncs.size() > 0 && receivedResyncs[0].frame == game.frame)
-        {
-            game = receivedResyncs[0];
-            game.reassignEntityGamePointers();
+            vector<boost::shared_ptr<Cmd>> compactedCmds =
+                playerIdOrNegativeOne >= 0 ? controlGroupCache.compactCmd(cmdsToSend[i]) : vector<boost::shared_ptr<Cmd>>{cmdsToSend[i]};
 
-            receivedResyncs.erase(receivedResyncs.begin());
+            for (uint j=0; j < compactedCmds.size(); j++)
+            {
+                connectionHandler.queueCmd(compactedCmds[j]);
+            }
         }
+        cmdsToSend.clear();
 
-        FrameEventsPacket fcp = receivedFrameCmdsPackets[0];
-        receivedFrameCmdsPackets.erase(receivedFrameCmdsPackets.begin());
-
-        assert(fcp.frame == game.frame);
-
-        // go through events
-        for (unsigned int i = 0; i < fcp.events.size(); i++)
+        // usually just the one; the extras, if we're catching up, don't get displayed
+        uint64_t firstFrameRun = game.frame;
+        unsigned int framesToRun = receivedFrameCmdsPackets.framesToRun(inputDelay);
+        bool gameStarted = false;
+        for (unsigned int i = 0; i < framesToRun && readyForNextFrame(); i++)
         {
-            fcp.events[i]->execute(&game);
-        }
-        
-        // go through cmds
-        for (unsigned int i = 0; i < fcp.authdCmds.size(); i++)
-        {
-            auto cmd = fcp.authdCmds[i]->cmd;
-            if (auto unitCmd = boost::dynamic_pointer_cast<UnitCmd, Cmd>(cmd))
-            {
-                unitCmd->executeAsPlayer(&game, fcp.authdCmds[i]->playerAddress);
-            }
-            else if (auto spawnBeaconCmd = boost::dynamic_pointer_cast<SpawnBeaconCmd, Cmd>(cmd))
-            {
-                spawnBeaconCmd->executeAsPlayer(&game, fcp.authdCmds[i]->playerAddress);
-            }
-            else if (auto withdrawCmd = boost::dynamic_pointer_cast<WithdrawCmd, Cmd>(cmd))
-            {
-                // ignore. Server processes withdrawals and creates an event.
-            }
-            else
-            {
-                cout << "Woah, I don't know how to handle that cmd as a client!" << endl;
-            }
+            if (runNextFrame())
+                gameStarted = true;
         }
 
-        game.iterate();
         ui.iterate();
         if (ui.quitNow)
         {
@@ -365,23 +844,17 @@ int main(int argc, char *argv[])
             playerIdOrNegativeOne = game.playerAddressToIdOrNegativeOne(playerAddress);
         }
 
-        // check for game start cmd, and do some ux prep if we got one
-        for (uint i=0; i<fcp.events.size(); i++)
+        // do some ux prep if the game's started
+        if (gameStarted && playerIdOrNegativeOne >= 0)
         {
-            if (auto gse = boost::dynamic_pointer_cast<HoneypotAddedEvent, Event>(fcp.events[i]))
+            // find owned unit and center on it
+            for (uint i=0; i<game.entities.size(); i++)
             {
-                if (playerIdOrNegativeOne >= 0)
+                if (auto unit = boost::dynamic_pointer_cast<Unit, Entity>(game.entities[i]))
                 {
-                    // find owned unit and center on it
-                    for (uint i=0; i<game.entities.size(); i++)
+                    if (unit->ownerId == playerIdOrNegativeOne)
                     {
-                        if (auto unit = boost::dynamic_pointer_cast<Unit, Entity>(game.entities[i]))
-                        {
-                            if (unit->ownerId == playerIdOrNegativeOne)
-                            {
-                                ui.camera.gamePos = unit->pos;
-                            }
-                        }
+                        ui.camera.gamePos = unit->pos;
                     }
                 }
             }
@@ -392,7 +865,7 @@ int main(int argc, char *argv[])
         if (now <= nextFrameStart)
             display(window, &game, ui, &particles, game.playerAddressToIdOrNegativeOne(playerAddress));
 
-        if (game.frame % 200 == 0)
+        if (game.frame / 200 != firstFrameRun / 200)
             cout << "num ncps " << receivedFrameCmdsPackets.size() << endl;
     }
     delete window;
@@ -401,9 +874,11 @@ int main(int argc, char *argv[])
     if (playerIdOrNegativeOne >= 0)
     {
         cout << "Withdrawing your " << game.players[playerIdOrNegativeOne].credit.getDollarString().toAnsiString() << " now..." << endl;
-        connectionHandler.sendCmd(boost::shared_ptr<WithdrawCmd>(new WithdrawCmd(coinsInt(0))));
+        connectionHandler.queueCmd(boost::shared_ptr<WithdrawCmd>(new WithdrawCmd(coinsInt(0))));
     } 
 
+    connectionHandler.stopNetworkThread();
+    connectionHandler.finishSending();
     socket.close();
 
     return 0;
@@ -5,39 +5,42 @@
 
 using namespace std;
 
-boost::shared_ptr<Cmd> unpackFullCmdAndMoveIter(vchIter *iter)
+boost::shared_ptr<Cmd> unpackFullCmdAndMoveIter(VchReader *reader)
 {
     unsigned char typechar;
-    *iter = unpackTypecharFromIter(*iter, &typechar);
+    unpackTypecharFromIter(reader, &typechar);
 
     switch (typechar)
     {
     case CMD_MOVE_CHAR:
-        return boost::shared_ptr<Cmd>(new MoveCmd(iter));
+        return boost::shared_ptr<Cmd>(new MoveCmd(reader));
     case CMD_PICKUP_CHAR:
-        return boost::shared_ptr<Cmd>(new PickupCmd(iter));
+        return boost::shared_ptr<Cmd>(new PickupCmd(reader));
     case CMD_PUTDOWN_CHAR:
-        return boost::shared_ptr<Cmd>(new PutdownCmd(iter));
+        return boost::shared_ptr<Cmd>(new PutdownCmd(reader));
     case CMD_GATEWAYBUILD_CHAR:
-        return boost::shared_ptr<Cmd>(new GatewayBuildCmd(iter));
+        return boost::shared_ptr<Cmd>(new GatewayBuildCmd(reader));
     case CMD_WITHDRAW_CHAR:
-        return boost::shared_ptr<Cmd>(new WithdrawCmd(iter));
+        return boost::shared_ptr<Cmd>(new WithdrawCmd(reader));
     case CMD_ATTACK_CHAR:
-        return boost::shared_ptr<Cmd>(new AttackCmd(iter));
+        return boost::shared_ptr<Cmd>(new AttackCmd(reader));
     case CMD_PRIMEBUILD_CHAR:
-        return boost::shared_ptr<Cmd>(new PrimeBuildCmd(iter));
+        return boost::shared_ptr<Cmd>(new PrimeBuildCmd(reader));
     case CMD_RESUMEBUILDING_CHAR:
-        return boost::shared_ptr<Cmd>(new ResumeBuildingCmd(iter));
+        return boost::shared_ptr<Cmd>(new ResumeBuildingCmd(reader));
     case CMD_SPAWNBEACON_CHAR:
-        return boost::shared_ptr<Cmd>(new SpawnBeaconCmd(iter));
+        return boost::shared_ptr<Cmd>(new SpawnBeaconCmd(reader));
     case CMD_SCUTTLE_CHAR:
-        return boost::shared_ptr<Cmd>(new ScuttleCmd(iter));
+        return boost::shared_ptr<Cmd>(new ScuttleCmd(reader));
+    case CMD_SETCONTROLGROUP_CHAR:
+        return boost::shared_ptr<Cmd>(new SetControlGroupCmd(reader));
     }
-    throw runtime_error("Trying to unpack an unrecognized cmd");
+    reader->fail(VchReader::UnknownTypechar);
+    return boost::shared_ptr<Cmd>();
 }
 
-AuthdCmd::AuthdCmd(boost::shared_ptr<Cmd> cmd, string playerAddress)
-    : cmd(cmd), playerAddress(playerAddress){}
+AuthdCmd::AuthdCmd(boost::shared_ptr<Cmd> cmd, uint32_t playerId)
+    : cmd(cmd), playerId(playerId){}
 
 unsigned char Cmd::getTypechar()
 {
@@ -51,20 +54,20 @@ void Cmd::pack(vch *dest)
 {
     throw runtime_error("pack is not defined for the command '" + getTypename() + "'");
 }
-void Cmd::unpackAndMoveIter(vchIter *iter)
+void Cmd::unpackAndMoveIter(VchReader *reader)
 {
     throw runtime_error("unpackAndMoveIter is not defined for the command '" + getTypename() + "'");
 }
 
 void Cmd::packCmd(vch *dest) {}
 
-void Cmd::unpackCmdAndMoveIter(vchIter *iter) {}
+void Cmd::unpackCmdAndMoveIter(VchReader *reader) {}
 
 Cmd::Cmd() {}
 
-Cmd::Cmd(vchIter *iter)
+Cmd::Cmd(VchReader *reader)
 {
-    unpackCmdAndMoveIter(iter);
+    unpackCmdAndMoveIter(reader);
 }
 
 
@@ -79,18 +82,18 @@ string WithdrawCmd::getTypename()
 void WithdrawCmd::pack(vch *dest)
 {
     packCmd(dest);
-    packToVch(dest, "L", amount);
+    VchWriter(dest).putVarint(amount);
 }
-void WithdrawCmd::unpackAndMoveIter(vchIter *iter)
+void WithdrawCmd::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackFromIter(*iter, "L", &amount);
+    amount = reader->getVarint<uint32_t>();
 }
 WithdrawCmd::WithdrawCmd(coinsInt amount)
     : amount(amount)
 {}
-WithdrawCmd::WithdrawCmd(vchIter *iter)
+WithdrawCmd::WithdrawCmd(VchReader *reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 
@@ -102,10 +105,9 @@ string SpawnBeaconCmd::getTypename()
 {
     return "SpawnBeaconCmd";
 }
-void SpawnBeaconCmd::executeAsPlayer(Game* game, string playerAddress)
+void SpawnBeaconCmd::executeAsPlayer(Game* game, uint32_t playerId)
 {
-    int playerId = game->playerAddressToIdOrNegativeOne(playerAddress);
-    if (playerId == -1)
+    if (playerId >= game->players.size())
         return;
         
     if (game->getPlayerBeaconAvailable(playerId))
@@ -120,59 +122,106 @@ void SpawnBeaconCmd::pack(vch *dest)
     packCmd(dest);
     packVector2f(dest, pos);
 }
-void SpawnBeaconCmd::unpackAndMoveIter(vchIter *iter)
+void SpawnBeaconCmd::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackVector2f(*iter, &pos);
+    unpackVector2f(reader, &pos);
 }
 SpawnBeaconCmd::SpawnBeaconCmd(vector2f pos)
     : pos(pos)
 {}
-SpawnBeaconCmd::SpawnBeaconCmd(vchIter *iter)
+SpawnBeaconCmd::SpawnBeaconCmd(VchReader *reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 
-UnitCmd::UnitCmd(vector<EntityRef> unitRefs) : unitRefs(unitRefs) {}
-UnitCmd::UnitCmd(vchIter *iter)
+unsigned char SetControlGroupCmd::getTypechar()
 {
-    unpackUnitCmdAndMoveIter(iter);
+    return CMD_SETCONTROLGROUP_CHAR;
+}
+string SetControlGroupCmd::getTypename()
+{
+    return "SetControlGroupCmd";
+}
+void SetControlGroupCmd::executeAsPlayer(Game* game, uint32_t playerId)
+{
+    if (playerId >= game->players.size())
+        return;
+
+    if (groupId >= MAX_CONTROL_GROUPS)
+    {
+        cout << "Ignoring a SetControlGroupCmd with an out-of-range groupId" << endl;
+        return;
+    }
+
+    game->players[playerId].setControlGroup(groupId, unitRefs);
+}
+void SetControlGroupCmd::pack(vch *dest)
+{
+    packCmd(dest);
+    VchWriter(dest).put<uint8_t>(groupId);
+    packEntityRefSet(dest, unitRefs);
+}
+void SetControlGroupCmd::unpackAndMoveIter(VchReader *reader)
+{
+    groupId = reader->get<uint8_t>();
+    unpackEntityRefSet(reader, &unitRefs);
+}
+SetControlGroupCmd::SetControlGroupCmd(uint8_t groupId, vector<EntityRef> unitRefs)
+    : groupId(groupId), unitRefs(sortedUniqueEntityRefs(unitRefs))
+{}
+SetControlGroupCmd::SetControlGroupCmd(VchReader *reader)
+{
+    unpackAndMoveIter(reader);
+}
+
+
+UnitCmd::UnitCmd(vector<EntityRef> unitRefs) : unitRefs(sortedUniqueEntityRefs(unitRefs)) {}
+UnitCmd::UnitCmd(VchReader *reader)
+{
+    unpackUnitCmdAndMoveIter(reader);
+}
+void UnitCmd::useControlGroup(uint8_t groupId)
+{
+    maybeControlGroup = {groupId};
+    unitRefs.clear();
 }
 void UnitCmd::packUnitCmd(vch *dest)
 {
-    if (unitRefs.size() > 65535)
+    if (maybeControlGroup)
     {
-        throw runtime_error("too many units referenced in that command!");
+        VchWriter w(dest);
+        w.put<uint8_t>(UNITCMD_CONTROLGROUP_REFSET);
+        w.put<uint8_t>(*maybeControlGroup);
     }
-    uint16_t numUnitRefs = unitRefs.size();
-    packToVch(dest, "H", numUnitRefs);
-    for (unsigned i = 0; i < numUnitRefs; i++)
+    else
     {
-        packEntityRef(dest, unitRefs[i]);
+        packEntityRefSet(dest, unitRefs);
     }
 }
-void UnitCmd::unpackUnitCmdAndMoveIter(vchIter *iter)
+void UnitCmd::unpackUnitCmdAndMoveIter(VchReader *reader)
 {
-    uint16_t numUnitRefs;
-    *iter = unpackFromIter(*iter, "H", &numUnitRefs);
-    for (unsigned i = 0; i < numUnitRefs; i++)
+    // peek at the encoding; anything other than a control group is a regular entity ref set
+    if (reader->peek() == UNITCMD_CONTROLGROUP_REFSET)
     {
-        EntityRef unitRef;
-        *iter = unpackEntityRef(*iter, &unitRef);
-        unitRefs.push_back(unitRef);
+        reader->get<uint8_t>(); // the marker we just peeked at
+        maybeControlGroup = {reader->get<uint8_t>()};
+    }
+    else
+    {
+        unpackEntityRefSet(reader, &unitRefs);
     }
 }
 
-void UnitCmd::executeAsPlayer(Game *game, string playerAddress)
+void UnitCmd::executeAsPlayer(Game *game, uint32_t playerId)
 {
-    int playerId = game->playerAddressToIdOrNegativeOne(playerAddress);
-    if (playerId == -1)
+    if (playerId >= game->players.size())
         return;
         
-    vector<boost::shared_ptr<Unit>> units = getUnits(game);
+    vector<boost::shared_ptr<Unit>> units = getUnits(game, playerId);
     for (uint i = 0; i < units.size(); i++)
     {
-        if (units[i]->ownerId == playerId)
+        if (units[i]->ownerId == (int)playerId)
         {
             executeOnUnit(units[i]);
         }
@@ -183,12 +232,14 @@ void UnitCmd::executeOnUnit(boost::shared_ptr<Unit> u)
     throw runtime_error("executeOnUnit is not defined for the command '" + getTypename() + "'");
 }
 
-vector<boost::shared_ptr<Unit>> UnitCmd::getUnits(Game *game)
+vector<boost::shared_ptr<Unit>> UnitCmd::getUnits(Game *game, int playerId)
 {
+    vector<EntityRef> refs = maybeControlGroup ? game->players[playerId].getControlGroup(*maybeControlGroup) : unitRefs;
+
     vector<boost::shared_ptr<Unit>> units;
-    for (uint i = 0; i < unitRefs.size(); i++)
+    for (uint i = 0; i < refs.size(); i++)
     {
-        if (boost::shared_ptr<Unit> u = boost::dynamic_pointer_cast<Unit, Entity>(entityRefToPtrOrNull(*game, unitRefs[i])))
+        if (boost::shared_ptr<Unit> u = boost::dynamic_pointer_cast<Unit, Entity>(entityRefToPtrOrNull(*game, refs[i])))
         {
             units.push_back(u);
         }
@@ -213,9 +264,9 @@ void MoveCmd::pack(vch *dest)
     packUnitCmd(dest);
     packVector2f(dest, pos);
 }
-void MoveCmd::unpackAndMoveIter(vchIter *iter)
+void MoveCmd::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackVector2f(*iter, &pos);
+    unpackVector2f(reader, &pos);
 }
 
 void MoveCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
@@ -231,9 +282,9 @@ void MoveCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
 }
 
 MoveCmd::MoveCmd(vector<EntityRef> units, vector2f pos) : UnitCmd(units), pos(pos) {}
-MoveCmd::MoveCmd(vchIter *iter) : UnitCmd(iter)
+MoveCmd::MoveCmd(VchReader *reader) : UnitCmd(reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 unsigned char PickupCmd::getTypechar()
@@ -249,9 +300,9 @@ void PickupCmd::pack(vch *dest)
     packUnitCmd(dest);
     packEntityRef(dest, goldRef);
 }
-void PickupCmd::unpackAndMoveIter(vchIter *iter)
+void PickupCmd::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackEntityRef(*iter, &goldRef);
+    unpackEntityRef(reader, &goldRef);
 }
 void PickupCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
 {
@@ -266,9 +317,9 @@ void PickupCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
 }
 
 PickupCmd::PickupCmd(vector<EntityRef> units, EntityRef goldRef) : UnitCmd(units), goldRef(goldRef) {}
-PickupCmd::PickupCmd(vchIter *iter) : UnitCmd(iter)
+PickupCmd::PickupCmd(VchReader *reader) : UnitCmd(reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 unsigned char PutdownCmd::getTypechar()
@@ -284,9 +335,9 @@ void PutdownCmd::pack(vch *dest)
     packUnitCmd(dest);
     target.pack(dest);
 }
-void PutdownCmd::unpackAndMoveIter(vchIter *iter)
+void PutdownCmd::unpackAndMoveIter(VchReader *reader)
 {
-    target = Target(iter);
+    target = Target(reader);
 }
 
 void PutdownCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
@@ -302,9 +353,9 @@ void PutdownCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
 }
 
 PutdownCmd::PutdownCmd(vector<EntityRef> units, Target target) : UnitCmd(units), target(target) {}
-PutdownCmd::PutdownCmd(vchIter *iter) : UnitCmd(iter), target(NULL_ENTITYREF)
+PutdownCmd::PutdownCmd(VchReader *reader) : UnitCmd(reader), target(NULL_ENTITYREF)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 unsigned char GatewayBuildCmd::getTypechar()
@@ -320,9 +371,9 @@ void GatewayBuildCmd::pack(vch *dest)
     packUnitCmd(dest);
     packTypechar(dest, buildTypechar);
 }
-void GatewayBuildCmd::unpackAndMoveIter(vchIter *iter)
+void GatewayBuildCmd::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackTypecharFromIter(*iter, &buildTypechar);
+    unpackTypecharFromIter(reader, &buildTypechar);
 }
 
 void GatewayBuildCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
@@ -340,10 +391,10 @@ void GatewayBuildCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
 GatewayBuildCmd::GatewayBuildCmd(vector<EntityRef> units, unsigned char buildTypechar)
     : UnitCmd(units), buildTypechar(buildTypechar) {}
 
-GatewayBuildCmd::GatewayBuildCmd(vchIter *iter)
-    : UnitCmd(iter)
+GatewayBuildCmd::GatewayBuildCmd(VchReader *reader)
+    : UnitCmd(reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 unsigned char PrimeBuildCmd::getTypechar()
@@ -360,10 +411,10 @@ void PrimeBuildCmd::pack(vch *dest)
     packTypechar(dest, buildTypechar);
     packVector2f(dest, buildPos);
 }
-void PrimeBuildCmd::unpackAndMoveIter(vchIter *iter)
+void PrimeBuildCmd::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackTypecharFromIter(*iter, &buildTypechar);
-    *iter = unpackVector2f(*iter, &buildPos);
+    unpackTypecharFromIter(reader, &buildTypechar);
+    unpackVector2f(reader, &buildPos);
 }
 
 void PrimeBuildCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
@@ -381,10 +432,10 @@ void PrimeBuildCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
 PrimeBuildCmd::PrimeBuildCmd(vector<EntityRef> units, unsigned char buildTypechar, vector2f buildPos)
     : UnitCmd(units), buildTypechar(buildTypechar), buildPos(buildPos) {}
 
-PrimeBuildCmd::PrimeBuildCmd(vchIter *iter)
-    : UnitCmd(iter)
+PrimeBuildCmd::PrimeBuildCmd(VchReader *reader)
+    : UnitCmd(reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 unsigned char AttackCmd::getTypechar()
@@ -400,9 +451,9 @@ void AttackCmd::pack(vch *dest)
     packUnitCmd(dest);
     packEntityRef(dest, targetUnit);
 }
-void AttackCmd::unpackAndMoveIter(vchIter *iter)
+void AttackCmd::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackEntityRef(*iter, &targetUnit);
+    unpackEntityRef(reader, &targetUnit);
 }
 
 void AttackCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
@@ -416,10 +467,10 @@ void AttackCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
 AttackCmd::AttackCmd(vector<EntityRef> units, EntityRef targetUnit)
     : UnitCmd(units), targetUnit(targetUnit)
 {}
-AttackCmd::AttackCmd(vchIter *iter)
-    : UnitCmd(iter)
+AttackCmd::AttackCmd(VchReader *reader)
+    : UnitCmd(reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 unsigned char ResumeBuildingCmd::getTypechar()
@@ -435,9 +486,9 @@ void ResumeBuildingCmd::pack(vch *dest)
     packUnitCmd(dest);
     packEntityRef(dest, targetUnit);
 }
-void ResumeBuildingCmd::unpackAndMoveIter(vchIter *iter)
+void ResumeBuildingCmd::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackEntityRef(*iter, &targetUnit);
+    unpackEntityRef(reader, &targetUnit);
 }
 
 void ResumeBuildingCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
@@ -451,10 +502,10 @@ void ResumeBuildingCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
 ResumeBuildingCmd::ResumeBuildingCmd(vector<EntityRef> units, EntityRef targetUnit)
     : UnitCmd(units), targetUnit(targetUnit)
 {}
-ResumeBuildingCmd::ResumeBuildingCmd(vchIter *iter)
-    : UnitCmd(iter)
+ResumeBuildingCmd::ResumeBuildingCmd(VchReader *reader)
+    : UnitCmd(reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 unsigned char ScuttleCmd::getTypechar()
@@ -470,9 +521,9 @@ void ScuttleCmd::pack(vch *dest)
     packUnitCmd(dest);
     packEntityRef(dest, targetUnit);
 }
-void ScuttleCmd::unpackAndMoveIter(vchIter *iter)
+void ScuttleCmd::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackEntityRef(*iter, &targetUnit);
+    unpackEntityRef(reader, &targetUnit);
 }
 
 void ScuttleCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
@@ -494,8 +545,55 @@ void ScuttleCmd::executeOnUnit(boost::shared_ptr<Unit> unit)
 ScuttleCmd::ScuttleCmd(vector<EntityRef> units, EntityRef targetUnit)
     : UnitCmd(units), targetUnit(targetUnit)
 {}
-ScuttleCmd::ScuttleCmd(vchIter *iter)
-    : UnitCmd(iter)
+ScuttleCmd::ScuttleCmd(VchReader *reader)
+    : UnitCmd(reader)
+{
+    unpackAndMoveIter(reader);
+}
+
+ControlGroupCache::ControlGroupCache()
+    : nextGroupToReplace(0) {}
+
+void ControlGroupCache::clear()
 {
-    unpackAndMoveIter(iter);
+    groups.clear();
+    nextGroupToReplace = 0;
+}
+
+vector<boost::shared_ptr<Cmd>> ControlGroupCache::compactCmd(boost::shared_ptr<Cmd> cmd)
+{
+    auto unitCmd = boost::dynamic_pointer_cast<UnitCmd, Cmd>(cmd);
+    if (!unitCmd || unitCmd->maybeControlGroup || unitCmd->unitRefs.size() < CONTROL_GROUP_MIN_UNITS)
+    {
+        return {cmd};
+    }
+
+    // unitRefs is kept sorted and unique, so we can compare directly
+    for (uint i = 0; i < groups.size(); i++)
+    {
+        if (groups[i] == unitCmd->unitRefs)
+        {
+            unitCmd->useControlGroup(i);
+            return {cmd};
+        }
+    }
+
+    // not seen before; define a new group (or overwrite the oldest) and point the cmd at it
+    uint8_t groupId;
+    if (groups.size() < MAX_CONTROL_GROUPS)
+    {
+        groupId = groups.size();
+        groups.push_back(unitCmd->unitRefs);
+    }
+    else
+    {
+        groupId = nextGroupToReplace;
+        groups[groupId] = unitCmd->unitRefs;
+        nextGroupToReplace = (nextGroupToReplace + 1) % MAX_CONTROL_GROUPS;
+    }
+
+    boost::shared_ptr<Cmd> setGroupCmd(new SetControlGroupCmd(groupId, unitCmd->unitRefs));
+    unitCmd->useControlGroup(groupId);
+
+    return {setGroupCmd, cmd};
 }
\ No newline at end of file
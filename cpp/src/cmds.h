@@ -24,26 +24,34 @@ const unsigned char CMD_PRIMEBUILD_CHAR = 6;
 const unsigned char CMD_RESUMEBUILDING_CHAR = 7;
 const unsigned char CMD_SPAWNBEACON_CHAR = 8;
 const unsigned char CMD_SCUTTLE_CHAR = 9;
+const unsigned char CMD_SETCONTROLGROUP_CHAR = 10;
+
+// UnitCmds write their units as an entity ref set (see REFSET_* in common.h), or as this
+// marker followed by the id of one of the player's control groups.
+const unsigned char UNITCMD_CONTROLGROUP_REFSET = 255;
 
 struct Cmd
 {
     virtual string getTypename();
     virtual unsigned char getTypechar();
     virtual void pack(vch *dest);
-    virtual void unpackAndMoveIter(vchIter *iter);
+    virtual void unpackAndMoveIter(VchReader *reader);
 
     void packCmd(vch *dest);
-    void unpackCmdAndMoveIter(vchIter *iter);
+    void unpackCmdAndMoveIter(VchReader *reader);
 
     Cmd();
-    Cmd(vchIter *);
+    Cmd(VchReader *);
 };
 
+// The server only authorizes cmds from addresses that are already players, so it can
+// refer to the sender by index; clients learn the index -> address mapping from the resync
+// and from the BalanceUpdateEvent that adds the player.
 struct AuthdCmd
 {
     boost::shared_ptr<Cmd> cmd;
-    string playerAddress;
-    AuthdCmd(boost::shared_ptr<Cmd> cmd, string playerAddress);
+    uint32_t playerId;
+    AuthdCmd(boost::shared_ptr<Cmd> cmd, uint32_t playerId);
 };
 
 struct WithdrawCmd : public Cmd
@@ -53,10 +61,10 @@ struct WithdrawCmd : public Cmd
     unsigned char getTypechar();
     string getTypename();
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
     WithdrawCmd(coinsInt amount);
-    WithdrawCmd(vchIter *iter);
+    WithdrawCmd(VchReader *reader);
 };
 
 struct SpawnBeaconCmd : public Cmd
@@ -66,29 +74,48 @@ struct SpawnBeaconCmd : public Cmd
     unsigned char getTypechar();
     string getTypename();
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
-    void executeAsPlayer(Game* game, string playerAddress);
+    void executeAsPlayer(Game* game, uint32_t playerId);
 
     SpawnBeaconCmd(vector2f pos);
-    SpawnBeaconCmd(vchIter *iter);
+    SpawnBeaconCmd(VchReader *reader);
+};
+
+struct SetControlGroupCmd : public Cmd
+{
+    uint8_t groupId;
+    vector<EntityRef> unitRefs;
+
+    unsigned char getTypechar();
+    string getTypename();
+    void pack(vch *dest);
+    void unpackAndMoveIter(VchReader *reader);
+
+    void executeAsPlayer(Game* game, uint32_t playerId);
+
+    SetControlGroupCmd(uint8_t groupId, vector<EntityRef> unitRefs);
+    SetControlGroupCmd(VchReader *reader);
 };
 
-boost::shared_ptr<Cmd> unpackFullCmdAndMoveIter(vchIter *iter);
+boost::shared_ptr<Cmd> unpackFullCmdAndMoveIter(VchReader *reader);
 
 struct UnitCmd : public Cmd
 {
     vector<EntityRef> unitRefs;
-    vector<boost::shared_ptr<Unit>> getUnits(Game *game);
+    optional<uint8_t> maybeControlGroup; // if set, unitRefs is ignored in favor of the player's control group
+    vector<boost::shared_ptr<Unit>> getUnits(Game *game, int playerId);
+
+    void useControlGroup(uint8_t groupId);
 
-    void executeAsPlayer(Game *, string userAddress);
+    void executeAsPlayer(Game *, uint32_t playerId);
     virtual void executeOnUnit(boost::shared_ptr<Unit> unit);
 
     void packUnitCmd(vch *dest);
-    void unpackUnitCmdAndMoveIter(vchIter *iter);
+    void unpackUnitCmdAndMoveIter(VchReader *reader);
 
     UnitCmd(vector<EntityRef> entityRefs);
-    UnitCmd(vchIter *iter);
+    UnitCmd(VchReader *reader);
 };
 
 struct MoveCmd : public UnitCmd
@@ -98,12 +125,12 @@ struct MoveCmd : public UnitCmd
     unsigned char getTypechar();
     string getTypename();
     void pack(vch *);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
     void executeOnUnit(boost::shared_ptr<Unit>);
 
     MoveCmd(vector<EntityRef> unitRefs, vector2f pos);
-    MoveCmd(vchIter *iter);
+    MoveCmd(VchReader *reader);
 };
 
 struct PickupCmd : public UnitCmd
@@ -113,12 +140,12 @@ struct PickupCmd : public UnitCmd
     unsigned char getTypechar();
     string getTypename();
     void pack(vch *);
-    void unpackAndMoveIter(vchIter *);
+    void unpackAndMoveIter(VchReader *);
 
     void executeOnUnit(boost::shared_ptr<Unit>);
 
     PickupCmd(vector<EntityRef>, EntityRef);
-    PickupCmd(vchIter *iter);
+    PickupCmd(VchReader *reader);
 };
 
 struct PutdownCmd : public UnitCmd
@@ -128,12 +155,12 @@ struct PutdownCmd : public UnitCmd
     unsigned char getTypechar();
     string getTypename();
     void pack(vch *);
-    void unpackAndMoveIter(vchIter *);
+    void unpackAndMoveIter(VchReader *);
 
     void executeOnUnit(boost::shared_ptr<Unit>);
 
     PutdownCmd(vector<EntityRef>, Target);
-    PutdownCmd(vchIter *iter);
+    PutdownCmd(VchReader *reader);
 };
 
 struct GatewayBuildCmd : public UnitCmd
@@ -143,12 +170,12 @@ struct GatewayBuildCmd : public UnitCmd
     unsigned char getTypechar();
     string getTypename();
     void pack(vch *);
-    void unpackAndMoveIter(vchIter *);
+    void unpackAndMoveIter(VchReader *);
 
     void executeOnUnit(boost::shared_ptr<Unit>);
 
     GatewayBuildCmd(vector<EntityRef>, unsigned char buildTypechar);
-    GatewayBuildCmd(vchIter *iter);
+    GatewayBuildCmd(VchReader *reader);
 };
 
 struct PrimeBuildCmd : public UnitCmd
@@ -159,12 +186,12 @@ struct PrimeBuildCmd : public UnitCmd
     unsigned char getTypechar();
     string getTypename();
     void pack(vch *);
-    void unpackAndMoveIter(vchIter *);
+    void unpackAndMoveIter(VchReader *);
 
     void executeOnUnit(boost::shared_ptr<Unit>);
 
     PrimeBuildCmd(vector<EntityRef>, unsigned char buildTypechar, vector2f buildPos);
-    PrimeBuildCmd(vchIter *iter);
+    PrimeBuildCmd(VchReader *reader);
 };
 
 struct AttackCmd : public UnitCmd
@@ -174,12 +201,12 @@ struct AttackCmd : public UnitCmd
     unsigned char getTypechar();
     string getTypename();
     void pack(vch *);
-    void unpackAndMoveIter(vchIter *);
+    void unpackAndMoveIter(VchReader *);
 
     void executeOnUnit(boost::shared_ptr<Unit>);
 
     AttackCmd(vector<EntityRef>, EntityRef);
-    AttackCmd(vchIter *iter);
+    AttackCmd(VchReader *reader);
 };
 
 struct ResumeBuildingCmd : public UnitCmd
@@ -189,12 +216,12 @@ struct ResumeBuildingCmd : public UnitCmd
     unsigned char getTypechar();
     string getTypename();
     void pack(vch *);
-    void unpackAndMoveIter(vchIter *);
+    void unpackAndMoveIter(VchReader *);
 
     void executeOnUnit(boost::shared_ptr<Unit>);
 
     ResumeBuildingCmd(vector<EntityRef>, EntityRef);
-    ResumeBuildingCmd(vchIter *iter);
+    ResumeBuildingCmd(VchReader *reader);
 };
 
 struct ScuttleCmd : public UnitCmd
@@ -204,12 +231,25 @@ struct ScuttleCmd : public UnitCmd
     unsigned char getTypechar();
     string getTypename();
     void pack(vch *);
-    void unpackAndMoveIter(vchIter *);
+    void unpackAndMoveIter(VchReader *);
 
     void executeOnUnit(boost::shared_ptr<Unit>);
 
     ScuttleCmd(vector<EntityRef>, EntityRef);
-    ScuttleCmd(vchIter *iter);
+    ScuttleCmd(VchReader *reader);
+};
+
+// Client-side. Remembers which unit sets we've already given the server as control groups,
+// so that repeated commands to the same large selection only cost a group id on the wire.
+class ControlGroupCache
+{
+    vector<vector<EntityRef>> groups;
+    uint8_t nextGroupToReplace;
+public:
+    vector<boost::shared_ptr<Cmd>> compactCmd(boost::shared_ptr<Cmd> cmd);
+    void clear();
+
+    ControlGroupCache();
 };
 
 #endif // CMDS_H
\ No newline at end of file
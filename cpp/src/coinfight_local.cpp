@@ -32,7 +32,7 @@ void clearVchAndBuildCmdPacket(vch *dest, boost::shared_ptr<Cmd> cmd)
     cmd->pack(dest);
 
     vch prepended;
-    packToVch(&prepended, "H", (uint16_t)(dest->size()));
+    VchWriter(&prepended).put<uint16_t>(dest->size());
 
     dest->insert(dest->begin(), prepended.begin(), prepended.end());
 }
@@ -42,8 +42,9 @@ void clearVchAndPackResyncPacket(vch *dest)
     game.pack(dest);
 
     vch prepended;
-    packToVch(&prepended, "C", PACKET_RESYNC_CHAR);
-    packToVch(&prepended, "Q", (uint64_t)(dest->size()));
+    VchWriter w(&prepended);
+    w.put<uint8_t>(PACKET_RESYNC_CHAR);
+    w.put<uint64_t>(dest->size());
 
     dest->insert(dest->begin(), prepended.begin(), prepended.end());
 }
@@ -54,8 +55,9 @@ void clearVchAndPackFrameCmdsPacket(vch *dest, FrameEventsPacket fcp)
     fcp.pack(dest);
 
     vch prepended;
-    packToVch(&prepended, "C", PACKET_FRAMECMDS_CHAR);
-    packToVch(&prepended, "Q", (uint64_t)dest->size());
+    VchWriter w(&prepended);
+    w.put<uint8_t>(PACKET_FRAMECMDS_CHAR);
+    w.put<uint64_t>(dest->size());
 
     dest->insert(dest->begin(), prepended.begin(), prepended.end());
 }
@@ -83,8 +85,8 @@ int main(int argc, char *argv[])
 
     vector<boost::shared_ptr<Event>> firstEvents;
 
-    firstEvents.push_back(boost::shared_ptr<Event>(new BalanceUpdateEvent("0xf00", 15000, true)));
-    firstEvents.push_back(boost::shared_ptr<Event>(new BalanceUpdateEvent("0x0f0", 15000, true)));
+    firstEvents.push_back(boost::shared_ptr<Event>(new BalanceUpdateEvent(&game, "0xf00", 15000, true)));
+    firstEvents.push_back(boost::shared_ptr<Event>(new BalanceUpdateEvent(&game, "0x0f0", 15000, true)));
     firstEvents.push_back(boost::shared_ptr<Event>(new HoneypotAddedEvent(honeypotStartingAmount)));
     
     for (uint i=0; i<firstEvents.size(); i++)
@@ -151,10 +153,10 @@ int main(int argc, char *argv[])
             vector<boost::shared_ptr<AuthdCmd>> authdCmds;
             for (uint i=0; i<packages.size(); i++)
             {
-                vchIter place = packages[i]->begin() + 2; // we're looking past the size specifier, because in this case we already know...
+                VchReader reader(packages[i]->data() + 2, packages[i]->size() - 2); // we're looking past the size specifier, because in this case we already know...
 
-                boost::shared_ptr<Cmd> cmd = unpackFullCmdAndMoveIter(&place);
-                boost::shared_ptr<AuthdCmd> authdCmd = boost::shared_ptr<AuthdCmd>(new AuthdCmd(cmd, game.playerIdToAddress(currentPlayerId)));
+                boost::shared_ptr<Cmd> cmd = unpackFullCmdAndMoveIter(&reader);
+                boost::shared_ptr<AuthdCmd> authdCmd = boost::shared_ptr<AuthdCmd>(new AuthdCmd(cmd, currentPlayerId));
 
                 authdCmds.push_back(authdCmd);
 
@@ -167,11 +169,15 @@ int main(int argc, char *argv[])
                 auto cmd = authdCmds[i]->cmd;
                 if (auto unitCmd = boost::dynamic_pointer_cast<UnitCmd, Cmd>(cmd))
                 {
-                    unitCmd->executeAsPlayer(&game, authdCmds[i]->playerAddress);
+                    unitCmd->executeAsPlayer(&game, authdCmds[i]->playerId);
                 }
                 else if (auto spawnBeaconCmd = boost::dynamic_pointer_cast<SpawnBeaconCmd, Cmd>(cmd))
                 {
-                    spawnBeaconCmd->executeAsPlayer(&game, authdCmds[i]->playerAddress);
+                    spawnBeaconCmd->executeAsPlayer(&game, authdCmds[i]->playerId);
+                }
+                else if (auto setControlGroupCmd = boost::dynamic_pointer_cast<SetControlGroupCmd, Cmd>(cmd))
+                {
+                    setControlGroupCmd->executeAsPlayer(&game, authdCmds[i]->playerId);
                 }
                 else if (auto withdrawCmd = boost::dynamic_pointer_cast<WithdrawCmd, Cmd>(cmd))
                 {
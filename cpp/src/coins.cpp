@@ -2,7 +2,7 @@
 #include <SFML/Graphics.hpp>
 #include <cmath>
 #include "coins.h"
-#include "vchpack.h"
+#include "vchstream.h"
 
 Coins::Coins()
     : heldAmount(0), max(MAX_COINS) {}
@@ -122,17 +122,16 @@ bool Coins::tryTransfer(unsigned long transferAmount, Coins* to)
 }
 
 using vch = vector<unsigned char>;
-using vchIter = vector<unsigned char>::iterator;
 
-Coins::Coins(vchIter *iter)
+Coins::Coins(VchReader *reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 void Coins::pack(vch *dest)
 {
-    packToVch(dest, "L", heldAmount);
+    VchWriter(dest).putVarint(heldAmount);
 }
-void Coins::unpackAndMoveIter(vchIter *iter)
+void Coins::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackFromIter(*iter, "L", &heldAmount);
+    heldAmount = reader->getVarint<uint32_t>();
 }
\ No newline at end of file
@@ -7,9 +7,10 @@
 
 using namespace std;
 using vch = vector<unsigned char>;
-using vchIter = vector<unsigned char>::iterator;
 using coinsInt = unsigned long;
 
+class VchReader;
+
 extern const coinsInt MAX_COINS;
 
 coinsInt weiDepositStringToCoinsInt(string weiString);
@@ -29,14 +30,14 @@ public:
     sf::String getDollarString();
     Coins();
     Coins(coinsInt);
-    Coins(vchIter*);
+    Coins(VchReader *);
     coinsInt getSpaceLeft();
     bool createMoreByFiat(coinsInt);
     bool destroySomeByFiat(coinsInt);
     coinsInt transferUpTo(coinsInt, Coins*);
     bool tryTransfer(coinsInt, Coins*);
     void pack(vch*);
-    void unpackAndMoveIter(vchIter*);
+    void unpackAndMoveIter(VchReader *);
 };
 
 #endif // COINS_H
\ No newline at end of file
@@ -1,5 +1,8 @@
 #include <iostream>
 #include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include "config.h"
 #include "common.h"
 #include "coins.h"
 
@@ -7,7 +10,7 @@ using namespace std;
 
 void packTypechar(vch *dest, unsigned char typechar)
 {
-    packToVch(dest, "C", typechar);
+    VchWriter(dest).put<uint8_t>(typechar);
 }
 
 void debugOutputVch(vch out)
@@ -33,51 +36,276 @@ void prependVchWithSize(vch *vchDest)
 {
     uint64_t packetSize = vchDest->size();
     vch sizeData;
-    packToVch(&sizeData, "Q", packetSize);
+    VchWriter(&sizeData).put<uint64_t>(packetSize);
 
     vchDest->insert(vchDest->begin(), sizeData.begin(), sizeData.end());
 }
 
+int32_t floatToFixed(float f)
+{
+    if (!(fabs(f) <= VECTOR2F_FIXED_RANGE))
+        throw runtime_error("Trying to pack a float outside of VECTOR2F_FIXED_RANGE");
+
+    return lround(f * VECTOR2F_FIXED_SCALE);
+}
+float fixedToFloat(int32_t i)
+{
+    return i / VECTOR2F_FIXED_SCALE;
+}
+
 void packVector2f(vch *destVch, const vector2f &v)
 {
-    packToVch(destVch, "ff", v.x, v.y);
+    VchWriter w(destVch);
+    switch (VECTOR2F_ENCODING)
+    {
+    case VECTOR2F_ENCODING_HALF:
+        w.putHalfFloat(v.x);
+        w.putHalfFloat(v.y);
+        break;
+    case VECTOR2F_ENCODING_FLOAT32:
+        w.putFloat(v.x);
+        w.putFloat(v.y);
+        break;
+    case VECTOR2F_ENCODING_FIXED:
+        w.putSignedVarint(floatToFixed(v.x));
+        w.putSignedVarint(floatToFixed(v.y));
+        break;
+    }
 }
 
-vchIter unpackVector2f(vchIter src, vector2f *v)
+void unpackVector2f(VchReader *reader, vector2f *v)
 {
-    return unpackFromIter(src, "ff", &v->x, &v->y);
+    switch (VECTOR2F_ENCODING)
+    {
+    case VECTOR2F_ENCODING_HALF:
+        v->x = reader->getHalfFloat();
+        v->y = reader->getHalfFloat();
+        break;
+    case VECTOR2F_ENCODING_FLOAT32:
+        v->x = reader->getFloat();
+        v->y = reader->getFloat();
+        break;
+    case VECTOR2F_ENCODING_FIXED:
+        v->x = fixedToFloat(reader->getSignedVarint<int32_t>());
+        v->y = fixedToFloat(reader->getSignedVarint<int32_t>());
+        break;
+    }
 }
 
-vchIter unpackTypecharFromIter(vchIter src, unsigned char *typechar)
+void unpackTypecharFromIter(VchReader *reader, unsigned char *typechar)
 {
-    return unpackFromIter(src, "C", typechar);
+    *typechar = reader->get<uint8_t>();
 }
 
+// refs are varints: the null ref and early refs take a single byte
 void packEntityRef(vch *destVch, EntityRef ref)
 {
-    packToVch(destVch, "H", ref);
+    VchWriter(destVch).putVarint(ref);
 }
-vchIter unpackEntityRef(vchIter iter, EntityRef *ref)
+void unpackEntityRef(VchReader *reader, EntityRef *ref)
 {
-    return unpackFromIter(iter, "H", ref);
+    *ref = reader->getVarint<EntityRef>();
 }
 
-void packStringToVch(std::vector<unsigned char> *vch, string s)
+unsigned int getVarintSize(uint64_t val)
 {
-    char* cstr;
-    cstr = &s[0];
-    packToVch(vch, "s", cstr);
+    unsigned int size = 1;
+    while (val >= 0x80)
+    {
+        val >>= 7;
+        size++;
+    }
+    return size;
 }
-vchIter unpackStringFromIter(vchIter iter, uint16_t maxSize, string *s)
+
+vector<EntityRef> sortedUniqueEntityRefs(vector<EntityRef> refs)
 {
-    char formatStr[7];
-    snprintf(formatStr, sizeof(formatStr), "%ds", maxSize);
+    sort(refs.begin(), refs.end());
+    refs.erase(unique(refs.begin(), refs.end()), refs.end());
+    return refs;
+}
 
-    char cstr[maxSize+1];
-    vchIter newIter = unpackFromIter(iter, formatStr, cstr);
-    *s = string(cstr);
+// splits sorted, unique refs into runs of consecutive refs, as (firstRef, length) pairs
+vector<pair<EntityRef, unsigned int>> entityRefRuns(const vector<EntityRef> &sortedRefs)
+{
+    vector<pair<EntityRef, unsigned int>> runs;
+    for (uint i = 0; i < sortedRefs.size(); i++)
+    {
+        if (runs.size() > 0 && runs.back().first + runs.back().second == sortedRefs[i])
+            runs.back().second++;
+        else
+            runs.push_back({sortedRefs[i], 1});
+    }
+    return runs;
+}
+
+void packEntityRefSet(vch *destVch, vector<EntityRef> refs)
+{
+    refs = sortedUniqueEntityRefs(refs);
+
+    if (refs.size() > 65535)
+    {
+        throw runtime_error("too many refs to pack in an entity ref set!");
+    }
+
+    vector<pair<EntityRef, unsigned int>> runs = entityRefRuns(refs);
 
-    return newIter;
+    // figure out which encoding is smallest
+    unsigned int listSize = getVarintSize(refs.size());
+    EntityRef lastRef = 0;
+    for (uint i = 0; i < refs.size(); i++)
+    {
+        listSize += getVarintSize(refs[i] - lastRef);
+        lastRef = refs[i];
+    }
+
+    unsigned int runsSize = getVarintSize(runs.size());
+    EntityRef lastRunEnd = 0;
+    for (uint i = 0; i < runs.size(); i++)
+    {
+        runsSize += getVarintSize(runs[i].first - lastRunEnd) + getVarintSize(runs[i].second - 1);
+        lastRunEnd = runs[i].first + runs[i].second;
+    }
+
+    unsigned int bitsetSize = 0xffffffff;
+    EntityRef bitsetBase = 0;
+    unsigned int bitsetNumBytes = 0;
+    if (refs.size() > 0)
+    {
+        bitsetBase = refs.front();
+        bitsetNumBytes = (refs.back() - bitsetBase) / 8 + 1;
+        bitsetSize = getVarintSize(bitsetBase) + getVarintSize(bitsetNumBytes) + bitsetNumBytes;
+    }
+
+    if (listSize <= runsSize && listSize <= bitsetSize)
+    {
+        VchWriter w(destVch);
+        w.put<uint8_t>(REFSET_LIST);
+        w.putVarint(refs.size());
+        lastRef = 0;
+        for (uint i = 0; i < refs.size(); i++)
+        {
+            w.putVarint(refs[i] - lastRef);
+            lastRef = refs[i];
+        }
+    }
+    else if (runsSize <= bitsetSize)
+    {
+        VchWriter w(destVch);
+        w.put<uint8_t>(REFSET_RUNS);
+        w.putVarint(runs.size());
+        lastRunEnd = 0;
+        for (uint i = 0; i < runs.size(); i++)
+        {
+            w.putVarint(runs[i].first - lastRunEnd);
+            w.putVarint(runs[i].second - 1);
+            lastRunEnd = runs[i].first + runs[i].second;
+        }
+    }
+    else
+    {
+        VchWriter w(destVch);
+        w.put<uint8_t>(REFSET_BITSET);
+        w.putVarint(bitsetBase);
+        w.putVarint(bitsetNumBytes);
+
+        vch bits(bitsetNumBytes, 0);
+        for (uint i = 0; i < refs.size(); i++)
+        {
+            unsigned int offset = refs[i] - bitsetBase;
+            bits[offset / 8] |= 1 << (offset % 8);
+        }
+        destVch->insert(destVch->end(), bits.begin(), bits.end());
+    }
+}
+void unpackEntityRefSet(VchReader *reader, vector<EntityRef> *refs)
+{
+    refs->clear();
+
+    unsigned char encoding = reader->get<uint8_t>();
+
+    switch (encoding)
+    {
+    case REFSET_LIST:
+    {
+        uint32_t numRefs = reader->getCount();
+        uint64_t ref = 0;
+        for (uint i = 0; i < numRefs && reader->ok(); i++)
+        {
+            ref += reader->getVarint<uint16_t>();
+            if (ref > 65535)
+            {
+                reader->fail(VchReader::ValueTooBig);
+                break;
+            }
+
+            refs->push_back(ref);
+        }
+        break;
+    }
+    case REFSET_RUNS:
+    {
+        uint32_t numRuns = reader->getCount();
+        uint64_t lastRunEnd = 0;
+        for (uint i = 0; i < numRuns && reader->ok(); i++)
+        {
+            uint64_t gap = reader->getVarint<uint16_t>();
+            uint64_t lengthMinusOne = reader->getVarint<uint16_t>();
+
+            uint64_t runStart = lastRunEnd + gap;
+            lastRunEnd = runStart + lengthMinusOne + 1;
+            if (lastRunEnd > (uint64_t)65536)
+            {
+                reader->fail(VchReader::ValueTooBig);
+                break;
+            }
+
+            for (uint64_t ref = runStart; ref < lastRunEnd; ref++)
+            {
+                refs->push_back(ref);
+            }
+        }
+        break;
+    }
+    case REFSET_BITSET:
+    {
+        uint64_t base = reader->getVarint<uint16_t>();
+        uint64_t numBytes = reader->getVarint<uint16_t>();
+        const unsigned char *bits = reader->getBytes(numBytes);
+        if (!bits)
+            break;
+
+        for (uint64_t i = 0; i < numBytes; i++)
+        {
+            for (unsigned int bit = 0; bit < 8; bit++)
+            {
+                if (!(bits[i] & (1 << bit)))
+                    continue;
+
+                uint64_t ref = base + i * 8 + bit;
+                if (ref > 65535)
+                {
+                    reader->fail(VchReader::ValueTooBig);
+                    return;
+                }
+
+                refs->push_back(ref);
+            }
+        }
+        break;
+    }
+    default:
+        reader->fail(VchReader::BadEncoding);
+    }
+}
+
+void packStringToVch(std::vector<unsigned char> *vch, string s)
+{
+    VchWriter(vch).putString(s);
+}
+void unpackStringFromIter(VchReader *reader, uint16_t maxSize, string *s)
+{
+    *s = string(reader->getString(maxSize));
 }
 
 bool entityRefIsNull(EntityRef ref)
@@ -3,6 +3,7 @@
 #include <boost/shared_ptr.hpp>
 #include "myvectors.h"
 #include "vchpack.h"
+#include "vchstream.h"
 #include "coins.h"
 
 #ifndef COMMON_H
@@ -22,16 +23,33 @@ void debugOutputVector(const char *,vector3f);
 
 void prependVchWithSize(vch *vchDest);
 
+// fixed-point for VECTOR2F_ENCODING_FIXED; see config.h
+int32_t floatToFixed(float f);
+float fixedToFloat(int32_t i);
+
 void packVector2f(vch *destVch, const vector2f &v);
-vchIter unpackVector2f(vchIter src, vector2f *v);
+void unpackVector2f(VchReader *reader, vector2f *v);
 
-vchIter unpackTypecharFromIter(vchIter src, unsigned char *typechar);
+void unpackTypecharFromIter(VchReader *reader, unsigned char *typechar);
 
 void packEntityRef(vch *destVch, EntityRef ref);
-vchIter unpackEntityRef(vchIter iter, EntityRef *ref);
+void unpackEntityRef(VchReader *reader, EntityRef *ref);
+
+// size of val as a VchWriter::putVarint
+unsigned int getVarintSize(uint64_t val);
+
+// A set of EntityRefs is written as one of these encodings, whichever comes out smallest.
+// Sets are always sorted and deduplicated, so every encoding unpacks to the same vector.
+const unsigned char REFSET_LIST = 0;   // varint count, then varint gap from the previous ref (or 0) per ref
+const unsigned char REFSET_RUNS = 1;   // varint numRuns, then (varint gap, varint length-1) per run
+const unsigned char REFSET_BITSET = 2; // varint base, varint numBytes, then one bit per ref from base
+
+vector<EntityRef> sortedUniqueEntityRefs(vector<EntityRef> refs);
+void packEntityRefSet(vch *destVch, vector<EntityRef> refs);
+void unpackEntityRefSet(VchReader *reader, vector<EntityRef> *refs);
 
 void packStringToVch(std::vector<unsigned char> *vch, string s);
-vchIter unpackStringFromIter(vchIter iter, uint16_t maxSize, string *s);
+void unpackStringFromIter(VchReader *reader, uint16_t maxSize, string *s);
 
 bool entityRefIsNull(EntityRef);
 std::optional<unsigned int> safeUIntAdd(unsigned int, unsigned int);
@@ -24,6 +24,84 @@ const unsigned char NULL_TYPECHAR = 0;
 
 const unsigned char PACKET_RESYNC_CHAR = 1;
 const unsigned char PACKET_FRAMECMDS_CHAR = 2;
+const unsigned char PACKET_DELTARESYNC_CHAR = 3;
+const unsigned char PACKET_FRAMEBATCH_CHAR = 4;
+const unsigned char PACKET_RESYNCCHUNK_CHAR = 5;
+const unsigned char PACKET_TICKINTERVAL_CHAR = 6;
+const unsigned char PACKET_CATCHUP_CHAR = 7;
+const unsigned char PACKET_INPUTDELAY_CHAR = 8;
+
+// A resync (full or delta) goes out as chunks of about RESYNC_CHUNK_SIZE bytes, split between entities,
+// each starting with a byte of these flags. See ResyncAssembler.
+const size_t RESYNC_CHUNK_SIZE = 16 * 1024;
+const unsigned char RESYNCCHUNK_FIRST_FLAG = 1;
+const unsigned char RESYNCCHUNK_LAST_FLAG = 2;
+const unsigned char RESYNCCHUNK_DELTA_FLAG = 4;
+
+// Set on a packet's typechar if its body is compressed (see lz.h): a varint of the uncompressed size, then the
+// compressed bytes. Resyncs and frame batches are compressed past PACKET_COMPRESSION_THRESHOLD bytes, as long
+// as it actually makes them smaller. A client won't decompress anything past MAX_DECOMPRESSED_PACKET_SIZE.
+const unsigned char PACKET_COMPRESSED_FLAG = 0x80;
+const size_t PACKET_COMPRESSION_THRESHOLD = 1024;
+const size_t MAX_DECOMPRESSED_PACKET_SIZE = 64 * 1024 * 1024;
+
+// Client and server read whatever's available, up to this much at a time (more if a message needs it), and
+// then handle every complete message they got.
+const size_t SOCKET_READ_SIZE = 16 * 1024;
+
+// A lagging client's frames are split over several batches past this, and a client won't
+// expand a batch that claims more.
+const unsigned int MAX_FRAMES_PER_BATCH = 60 * 60;
+
+// How much the server will queue up for a client that isn't keeping up. Past either cap, the queued frames
+// are dropped and the client gets a resync instead (a delta from where it'll be when it runs out of frames),
+// unless it's already been through MAX_LAGGARD_RESYNCS of those or is still getting one, in which case it's
+// disconnected.
+const size_t MAX_QUEUED_FRAMES = 60 * 10;
+const size_t MAX_QUEUED_BYTES = 4 * 1024 * 1024;
+const unsigned int MAX_LAGGARD_RESYNCS = 3;
+
+// The server keeps the last FRAME_HISTORY_SIZE frames it sent. A client that reconnects from a frame that's
+// still in there (PACKET_CATCHUP_CHAR) just gets the frames it missed, rather than a resync, as long as they'd
+// fit under the caps above.
+const size_t FRAME_HISTORY_SIZE = 60 * 10;
+
+// How long after a client signs the challenge its resumption tokens are good for (see resumptionToken.h). It can
+// skip signing on reconnects until then, and has to sign again after.
+const std::chrono::seconds RESUMPTION_TOKEN_LIFETIME(60 * 10);
+
+// Recovering a handshake's signer is done on a pool of AUTH_THREADS, away from the network threads. Past
+// MAX_PENDING_HANDSHAKES connections that haven't finished the handshake, new ones are turned away. Each step of
+// it has HANDSHAKE_STEP_TIMEOUT, except that the client gets HANDSHAKE_SIG_TIMEOUT to send the sig, since a
+// person might be signing the challenge by hand.
+const unsigned int AUTH_THREADS = 2;
+const unsigned int MAX_PENDING_HANDSHAKES = 256;
+const std::chrono::seconds HANDSHAKE_STEP_TIMEOUT(10);
+const std::chrono::seconds HANDSHAKE_SIG_TIMEOUT(120);
+
+// Closed channels are kept around for new connections to reuse, buffers and all, up to this many.
+const size_t MAX_IDLE_CHANNELS = 16;
+
+// The server does all its socket work on a pool of threads, one per core up to this many, leaving the tick
+// thread to run the game.
+const unsigned int MAX_NETWORK_THREADS = 4;
+
+// For the io_uring backend (server --io-uring): submission queue size, and the receive buffers the kernel
+// fills (a power of 2 of them). Clients don't send much, so small ones go a long way.
+const unsigned int URING_ENTRIES = 1024;
+const unsigned int URING_RECV_BUFFERS = 1024;
+const size_t URING_RECV_BUFFER_SIZE = 4096;
+
+// How vector2fs (positions, move targets) are encoded on the wire; client and server have to agree.
+// HALF is the old IEEE half-float encoding. It's lossy, so a freshly synced client drifts from the server.
+// FLOAT32 sends the float bits as-is. FIXED sends signed varints in 1/VECTOR2F_FIXED_SCALE units and
+// throws outside +/- VECTOR2F_FIXED_RANGE.
+const unsigned char VECTOR2F_ENCODING_HALF = 0;
+const unsigned char VECTOR2F_ENCODING_FLOAT32 = 1;
+const unsigned char VECTOR2F_ENCODING_FIXED = 2;
+const unsigned char VECTOR2F_ENCODING = VECTOR2F_ENCODING_FLOAT32;
+const float VECTOR2F_FIXED_SCALE = 1024;
+const float VECTOR2F_FIXED_RANGE = 1000000;
 
 const unsigned char GOLDPILE_TYPECHAR = 1;
 const unsigned char BEACON_TYPECHAR = 2;
@@ -33,6 +111,39 @@ const unsigned char GATEWAY_TYPECHAR = 5;
 
 const std::chrono::duration<double, std::ratio<1,60>> ONE_FRAME(1);
 
+// If a tick runs so late that the server's more than MAX_CATCHUP_TICKS behind, it skips the rest rather than
+// running them back to back.
+const unsigned int MAX_CATCHUP_TICKS = 5;
+const std::chrono::seconds TICK_STATS_INTERVAL(60);
+
+// If the work in a tick averages (over about TICK_LOAD_SMOOTHING ticks) more than TICK_OVERLOAD_LOAD of the
+// tick interval, the server slows down a step, ONE_FRAME / 4 at a time, up to MAX_TICK_SLOWDOWN_STEPS; under
+// TICK_RECOVER_LOAD it speeds back up. Clients are told (PACKET_TICKINTERVAL_CHAR) so they play frames back at
+// the same pace. At most one step per TICK_SLOWDOWN_COOLDOWN.
+const bool ALLOW_TICK_SLOWDOWN = true;
+const unsigned int TICK_LOAD_SMOOTHING = 60;
+const float TICK_OVERLOAD_LOAD = 0.9;
+const float TICK_RECOVER_LOAD = 0.5;
+const unsigned int MAX_TICK_SLOWDOWN_STEPS = 4;
+const std::chrono::seconds TICK_SLOWDOWN_COOLDOWN(2);
+
+// What the server receives is scheduled for the frame the input delay after the one it's on, and clients are sent
+// the frames in between right away, so they have that many in hand to ride out jitter with. The server re-tunes
+// it every INPUT_DELAY_TUNE_INTERVAL, a frame at a time, between MIN_INPUT_DELAY and MAX_INPUT_DELAY: enough to
+// cover INPUT_DELAY_JITTER_FACTOR times the RTT variation of the INPUT_DELAY_PERCENTILE'th client. Clients are told
+// (PACKET_INPUTDELAY_CHAR), and aim to keep that many frames in hand (see JitterBuffer).
+const unsigned int MIN_INPUT_DELAY = 2;
+const unsigned int MAX_INPUT_DELAY = 15;
+const std::chrono::seconds INPUT_DELAY_TUNE_INTERVAL(2);
+const float INPUT_DELAY_PERCENTILE = 0.9;
+const float INPUT_DELAY_JITTER_FACTOR = 4;
+
+// A client holding more than JITTER_BUFFER_SLACK frames past the input delay catches up, running an extra frame per
+// tick for every JITTER_BUFFER_CATCHUP_DIVISOR it's over, up to JITTER_BUFFER_MAX_EXTRA_FRAMES extra.
+const unsigned int JITTER_BUFFER_SLACK = 4;
+const unsigned int JITTER_BUFFER_CATCHUP_DIVISOR = 8;
+const unsigned int JITTER_BUFFER_MAX_EXTRA_FRAMES = 15;
+
 const float ENTITY_COLLIDE_RADIUS = 15;
 
 const int CREDIT_PER_DOLLAR_EXPONENT = 3; // credit = dollar * 10^X
@@ -68,6 +179,9 @@ const vector2f FIGHTER_SHOT_OFFSET(20, 10);
 
 const float SPACE_BETWEEN_SPAWNS = 500;
 
+const uint8_t MAX_CONTROL_GROUPS = 32; // per player
+const unsigned int CONTROL_GROUP_MIN_UNITS = 8; // smaller selections aren't worth defining a group for
+
 const float PARTICLE_MAGNET_STRENGTH = 1;
 const float PARTICLE_FRICTION_CONSTANT = 0.9;
 
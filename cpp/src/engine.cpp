@@ -30,23 +30,69 @@ EntityRef Game::getNextEntityRef()
     return entities.size() + 1;
 }
 
+vector<EntityRef> Player::getControlGroup(uint8_t groupId)
+{
+    auto found = controlGroups.find(groupId);
+    if (found == controlGroups.end())
+        return {};
+    else
+        return found->second;
+}
+void Player::setControlGroup(uint8_t groupId, vector<EntityRef> unitRefs)
+{
+    controlGroups[groupId] = unitRefs;
+    controlGroupsChangedSinceLastPoll = true;
+}
+
+bool Player::pollChanged()
+{
+    bool changed = credit.getInt() != creditAtLastPoll
+                || beaconAvailable != beaconAvailableAtLastPoll
+                || controlGroupsChangedSinceLastPoll;
+
+    creditAtLastPoll = credit.getInt();
+    beaconAvailableAtLastPoll = beaconAvailable;
+    controlGroupsChangedSinceLastPoll = false;
+
+    return changed;
+}
+
 void Player::pack(vch *dest)
 {
     packStringToVch(dest, address);
     credit.pack(dest);
+
+    VchWriter w(dest);
+    w.putVarint(controlGroups.size());
+    for (auto iter = controlGroups.begin(); iter != controlGroups.end(); iter++)
+    {
+        w.put<uint8_t>(iter->first);
+        packEntityRefSet(dest, iter->second);
+    }
 }
-void Player::unpackAndMoveIter(vchIter *iter)
+void Player::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackStringFromIter(*iter, 50, &address);
-    credit = Coins(iter);
+    unpackStringFromIter(reader, 50, &address);
+    credit = Coins(reader);
+
+    unsigned int numControlGroups = reader->getVarint<uint8_t>();
+    controlGroups.clear();
+    for (uint i = 0; i < numControlGroups; i++)
+    {
+        unsigned char groupId = reader->get<uint8_t>();
+        unpackEntityRefSet(reader, &controlGroups[groupId]);
+    }
 }
 
 Player::Player(string address)
-    : address(address), credit(), beaconAvailable(true) {}
+    : address(address), credit(), beaconAvailable(true),
+      creditAtLastPoll(0), beaconAvailableAtLastPoll(true), controlGroupsChangedSinceLastPoll(false) {}
 
-Player::Player(vchIter *iter)
+Player::Player(VchReader *reader)
+    : beaconAvailable(true), beaconAvailableAtLastPoll(true), controlGroupsChangedSinceLastPoll(false)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
+    creditAtLastPoll = credit.getInt();
 }
 
 int Game::playerAddressToIdOrNegativeOne(string address)
@@ -77,22 +123,55 @@ void Game::killAndReplaceEntity(EntityRef ref, boost::shared_ptr<Entity> newEnti
 {
     entities[ref-1]->die();
     entities[ref-1] = newEntity;
+    stampEntitySlotChanged(ref);
+}
+
+void Game::stampEntitySlotChanged(EntityRef ref)
+{
+    if (entityChangeStamps.size() < ref)
+        entityChangeStamps.resize(ref, frame);
+
+    entityChangeStamps[ref-1] = frame;
+}
+void Game::updateChangeStamps()
+{
+    // anything new since last time counts as changed on this frame
+    playerChangeStamps.resize(players.size(), frame);
+    entityChangeStamps.resize(entities.size(), frame);
+
+    for (uint i=0; i<players.size(); i++)
+    {
+        if (players[i].pollChanged())
+            playerChangeStamps[i] = frame;
+    }
+    for (EntityRef i = 0; i < entities.size(); i++)
+    {
+        if (entities[i] && entities[i]->pollChanged())
+            entityChangeStamps[i] = frame;
+    }
 }
 
-void Game::pack(vch *dest)
+void Game::pack(vch *dest, vector<size_t> *entityOffsets)
 {
-    packToVch(dest, "C", (unsigned char)(state));
-    packToVch(dest, "Q", frame);
+    VchWriter w(dest);
+    // most entities are gold piles at ~10 bytes; units run a bit over 16
+    w.reserve(16 + players.size() * 64 + entities.size() * 16);
+
+    w.put<uint8_t>(state);
+    w.putVarint(frame);
 
-    packToVch(dest, "C", (unsigned char)(players.size()));
+    w.putVarint(players.size());
     for (uint i=0; i < players.size(); i++)
     {
         players[i].pack(dest);
     }
 
-    packToVch(dest, "H", (EntityRef)(entities.size()));
+    w.putVarint(entities.size());
     for (EntityRef i = 0; i < entities.size(); i++)
     {
+        if (entityOffsets)
+            entityOffsets->push_back(dest->size());
+
         unsigned char typechar = getMaybeNullEntityTypechar(entities[i]);
 
         packTypechar(dest, typechar);
@@ -103,40 +182,220 @@ void Game::pack(vch *dest)
         }
     }
 }
-void Game::unpackAndMoveIter(vchIter *iter)
+void Game::unpackAndMoveIter(VchReader *reader)
 {
-    unsigned char enumInt;
-    *iter = unpackFromIter(*iter, "C", &enumInt);
-    state = static_cast<State>(enumInt);
+    EntityRef entitiesSize = unpackHeadAndMoveIter(reader);
 
-    *iter = unpackFromIter(*iter, "Q", &frame);
+    for (int i = 0; i < entitiesSize && reader->ok(); i++)
+    {
+        unpackNextEntityAndMoveIter(reader);
+    }
+}
+EntityRef Game::unpackHeadAndMoveIter(VchReader *reader)
+{
+    state = reader->getEnum<State>(Active);
+    frame = reader->getVarint();
     
-    uint8_t playersSize;
-    *iter = unpackFromIter(*iter, "C", &playersSize);
+    uint8_t playersSize = reader->getVarint<uint8_t>();
     players.clear();
 
-    for (int i = 0; i < playersSize; i++)
+    for (int i = 0; i < playersSize && reader->ok(); i++)
     {
-        players.push_back(Player(iter));
+        players.push_back(Player(reader));
     }
 
-    uint16_t entitiesSize;
-    *iter = unpackFromIter(*iter, "H", &entitiesSize);
+    EntityRef entitiesSize = reader->getVarint<EntityRef>();
     entities.clear();
 
-    for (int i = 0; i < entitiesSize; i++)
+    return entitiesSize;
+}
+void Game::unpackNextEntityAndMoveIter(VchReader *reader)
+{
+    unsigned char typechar;
+    unpackTypecharFromIter(reader, &typechar);
+
+    entities.push_back(unpackFullEntityAndMoveIter(reader, typechar, this, getNextEntityRef()));
+}
+
+// A delta has to carry each changed entity in full plus its ref, so past a point a full resync is cheaper.
+bool Game::deltaIsWorthwhile(uint64_t baselineFrame)
+{
+    if (baselineFrame == 0 || baselineFrame > frame)
+        return false;
+
+    unsigned int numChanged = 0;
+    for (EntityRef i = 0; i < entityChangeStamps.size(); i++)
+    {
+        if (entityChangeStamps[i] >= baselineFrame)
+            numChanged++;
+    }
+    return numChanged * 2 < entities.size();
+}
+
+// Packs everything that's changed on or after baselineFrame, for a client whose game is at baselineFrame.
+// Stamps are updated at the end of iterate(), so this should only be called between iterations.
+void Game::packDelta(vch *dest, uint64_t baselineFrame, vector<size_t> *entityOffsets)
+{
+    VchWriter w(dest);
+    w.put<uint8_t>(state);
+    w.putVarint(frame);
+    w.putVarint(frame - baselineFrame); // baseline goes as a delta; usually small
+
+    w.putVarint(players.size());
+    vector<uint8_t> changedPlayerIds;
+    for (uint i=0; i < players.size(); i++)
+    {
+        if (playerChangeStamps[i] >= baselineFrame)
+            changedPlayerIds.push_back(i);
+    }
+    w.putVarint(changedPlayerIds.size());
+    for (uint i=0; i < changedPlayerIds.size(); i++)
+    {
+        w.putVarint(changedPlayerIds[i]);
+        players[changedPlayerIds[i]].pack(dest);
+    }
+
+    w.putVarint(entities.size());
+    vector<EntityRef> changedRefs;
+    for (EntityRef i = 0; i < entities.size(); i++)
+    {
+        if (entityChangeStamps[i] >= baselineFrame)
+            changedRefs.push_back(i + 1);
+    }
+    packEntityRefSet(dest, changedRefs);
+    for (uint i=0; i < changedRefs.size(); i++)
+    {
+        if (entityOffsets)
+            entityOffsets->push_back(dest->size());
+
+        boost::shared_ptr<Entity> entity = entities[changedRefs[i] - 1];
+        unsigned char typechar = getMaybeNullEntityTypechar(entity);
+
+        packTypechar(dest, typechar);
+
+        if (typechar != NULL_TYPECHAR)
+        {
+            entity->pack(dest);
+        }
+    }
+}
+
+GameDelta::GameDelta() {}
+GameDelta::GameDelta(VchReader *reader)
+{
+    unpackHeadAndMoveIter(reader);
+
+    while (numEntitiesLeftToUnpack() > 0 && reader->ok())
+    {
+        unpackNextEntityAndMoveIter(reader);
+    }
+}
+void GameDelta::unpackHeadAndMoveIter(VchReader *reader)
+{
+    state = reader->getEnum<Game::State>(Game::Active);
+    frame = reader->getVarint();
+    uint64_t framesSinceBaseline = reader->getVarint();
+    if (framesSinceBaseline > frame)
+        reader->fail(VchReader::BadEncoding);
+    baselineFrame = frame - framesSinceBaseline;
+
+    numPlayers = reader->getVarint<uint8_t>();
+    unsigned int numChangedPlayers = reader->getVarint<uint8_t>();
+    for (uint i=0; i < numChangedPlayers && reader->ok(); i++)
+    {
+        unsigned char playerId = reader->getVarint<uint8_t>();
+        if (playerId >= numPlayers)
+            reader->fail(VchReader::BadEncoding);
+
+        changedPlayers.push_back({playerId, Player(reader)});
+    }
+
+    numEntities = reader->getVarint<EntityRef>();
+    changedRefs.clear();
+    unpackEntityRefSet(reader, &changedRefs);
+    if (changedRefs.size() > 0 && (changedRefs.front() == NULL_ENTITYREF || changedRefs.back() > numEntities))
+        reader->fail(VchReader::BadEncoding);
+
+    changedEntities.clear();
+}
+void GameDelta::unpackNextEntityAndMoveIter(VchReader *reader)
+{
+    if (numEntitiesLeftToUnpack() == 0)
+    {
+        reader->fail(VchReader::BadEncoding);
+        return;
+    }
+    EntityRef ref = changedRefs[changedEntities.size()];
+
+    unsigned char typechar;
+    unpackTypecharFromIter(reader, &typechar);
+
+    // game pointer gets filled in by Game::applyDelta
+    changedEntities.push_back({ref, unpackFullEntityAndMoveIter(reader, typechar, NULL, ref)});
+}
+size_t GameDelta::numEntitiesLeftToUnpack() const
+{
+    return changedRefs.size() - changedEntities.size();
+}
+
+void Game::applyDelta(const GameDelta &delta)
+{
+    if (delta.baselineFrame != frame)
+        throw runtime_error("Trying to apply a delta to a game that isn't at the delta's baseline frame");
+
+    state = delta.state;
+    frame = delta.frame;
+
+    players.resize(delta.numPlayers, Player(""));
+    for (uint i=0; i < delta.changedPlayers.size(); i++)
     {
-        unsigned char typechar;
-        *iter = unpackTypecharFromIter(*iter, &typechar);
+        if (delta.changedPlayers[i].first >= players.size())
+            throw runtime_error("Delta refers to a player that's out of range");
+
+        players[delta.changedPlayers[i].first] = delta.changedPlayers[i].second;
+    }
 
-        entities.push_back(unpackFullEntityAndMoveIter(iter, typechar, this, getNextEntityRef()));
+    entities.resize(delta.numEntities);
+    for (uint i=0; i < delta.changedEntities.size(); i++)
+    {
+        EntityRef ref = delta.changedEntities[i].first;
+        if (ref == NULL_ENTITYREF || ref > entities.size())
+            throw runtime_error("Delta refers to an entity that's out of range");
+
+        entities[ref - 1] = delta.changedEntities[i].second;
+    }
+    if (honeypotGoldPileIfGameStarted)
+    {
+        honeypotGoldPileIfGameStarted = boost::dynamic_pointer_cast<GoldPile, Entity>(entities[honeypotGoldPileIfGameStarted->ref - 1]);
     }
+
+    reassignEntityGamePointers();
 }
 
 Game::Game() : state(Active), frame(0) {}
-Game::Game(vchIter *iter)
+Game::Game(VchReader *reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
+}
+
+// Unlike a plain copy, which shares entities with the original, this copies every entity,
+// so the copy can be read (i.e. packed on another thread) while the original keeps changing.
+boost::shared_ptr<Game> Game::deepCopy()
+{
+    boost::shared_ptr<Game> copy(new Game(*this));
+
+    for (EntityRef i = 0; i < entities.size(); i++)
+    {
+        copy->entities[i] = cloneMaybeNullEntity(entities[i]);
+    }
+    if (honeypotGoldPileIfGameStarted)
+    {
+        copy->honeypotGoldPileIfGameStarted = boost::dynamic_pointer_cast<GoldPile, Entity>(copy->entities[honeypotGoldPileIfGameStarted->ref - 1]);
+    }
+
+    copy->reassignEntityGamePointers();
+
+    return copy;
 }
 
 // void Game::startMatch()
@@ -188,6 +447,7 @@ void Game::iterate()
     switch (state)
     {
         case Pregame:
+            updateChangeStamps();
             break;
         case Active:
             // iterate all units
@@ -221,9 +481,12 @@ void Game::iterate()
                         }
                     }
                     entities[i].reset();
+                    stampEntitySlotChanged(i + 1);
                 }
             }
 
+            updateChangeStamps();
+
             frame++;
 
             if (frame % 200 == 0)
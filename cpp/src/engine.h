@@ -4,6 +4,7 @@
 #include <boost/bind.hpp>
 #include <vector>
 #include <string>
+#include <map>
 #include <pthread.h>
 #include "coins.h"
 #include "myvectors.h"
@@ -26,14 +27,27 @@ struct Player
     string address;
     Coins credit;
     bool beaconAvailable;
+    map<uint8_t, vector<EntityRef>> controlGroups;
+
+    vector<EntityRef> getControlGroup(uint8_t groupId);
+    void setControlGroup(uint8_t groupId, vector<EntityRef> unitRefs);
+
+    bool pollChanged();
     
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
     Player(string address);
-    Player(vchIter *iter);
+    Player(VchReader *reader);
+
+private:
+    coinsInt creditAtLastPoll;
+    bool beaconAvailableAtLastPoll;
+    bool controlGroupsChangedSinceLastPoll;
 };
 
+struct GameDelta;
+
 void packFrameCmdsPacket(vch *dest, uint64_t frame);
 
 class Game
@@ -48,6 +62,13 @@ public:
     vector<boost::shared_ptr<Entity>> entities;
     boost::shared_ptr<GoldPile> honeypotGoldPileIfGameStarted;
 
+    // The last frame each player or entity slot changed on (created, modified, replaced or removed),
+    // updated at the end of each iterate(). Not packed; used to build deltas against a baseline frame.
+    vector<uint64_t> playerChangeStamps;
+    vector<uint64_t> entityChangeStamps;
+    void stampEntitySlotChanged(EntityRef);
+    void updateChangeStamps();
+
     boost::shared_ptr<Entity> entityRefToPtrOrNull(EntityRef);
     EntityRef getNextEntityRef();
 
@@ -58,11 +79,23 @@ public:
 
     void killAndReplaceEntity(EntityRef, boost::shared_ptr<Entity> newEntity);
 
-    void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    // If entityOffsets is given, it gets where each entity starts in dest, so the packed game can be
+    // split into chunks between entities. Everything before the first entity is the head.
+    void pack(vch *dest, vector<size_t> *entityOffsets = NULL);
+    void unpackAndMoveIter(VchReader *reader);
+
+    // unpackAndMoveIter, a piece at a time; see ResyncAssembler
+    EntityRef unpackHeadAndMoveIter(VchReader *reader); // returns how many entities follow
+    void unpackNextEntityAndMoveIter(VchReader *reader);
+
+    bool deltaIsWorthwhile(uint64_t baselineFrame);
+    void packDelta(vch *dest, uint64_t baselineFrame, vector<size_t> *entityOffsets = NULL);
+    void applyDelta(const GameDelta &delta);
 
     Game();
-    Game(vchIter *);
+    Game(VchReader *);
+
+    boost::shared_ptr<Game> deepCopy();
     // void startMatch();
     // void startMatchOrPrintError();
 
@@ -71,6 +104,27 @@ public:
     void iterate();
 };
 
+// Everything needed to bring a Game at baselineFrame up to frame; see Game::packDelta.
+struct GameDelta
+{
+    uint64_t baselineFrame;
+    Game::State state;
+    uint64_t frame;
+    uint8_t numPlayers;
+    vector<pair<uint8_t, Player>> changedPlayers;
+    EntityRef numEntities;
+    vector<EntityRef> changedRefs;
+    vector<pair<EntityRef, boost::shared_ptr<Entity>>> changedEntities; // null for removed entities
+
+    // like Game's, for unpacking a piece at a time
+    void unpackHeadAndMoveIter(VchReader *reader);
+    void unpackNextEntityAndMoveIter(VchReader *reader);
+    size_t numEntitiesLeftToUnpack() const;
+
+    GameDelta();
+    GameDelta(VchReader *reader);
+};
+
 vector<EntityRef> entityPtrsToRefs(vector<boost::shared_ptr<Entity>>);
 vector<EntityRef> entityPtrsToRefs(vector<boost::shared_ptr<Unit>>);
 boost::shared_ptr<Entity> entityRefToPtrOrNull(const Game&, EntityRef);
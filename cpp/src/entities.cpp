@@ -12,7 +12,7 @@
 
 void Target::pack(vch *dest)
 {
-    packToVch(dest, "C", (unsigned char)(type));
+    VchWriter(dest).put<uint8_t>(type);
     if (type == PointTarget)
     {
         packVector2f(dest, pointTarget);
@@ -22,25 +22,23 @@ void Target::pack(vch *dest)
         packEntityRef(dest, entityTarget);
     }
 }
-void Target::unpackAndMoveIter(vchIter *iter)
+void Target::unpackAndMoveIter(VchReader *reader)
 {
-    unsigned char enumInt;
-    *iter = unpackFromIter(*iter, "C", &enumInt);
-    type = static_cast<Type>(enumInt);
+    type = reader->getEnum<Type>(EntityTarget);
 
     if (type == PointTarget)
     {
-        *iter = unpackVector2f(*iter, &pointTarget);
+        unpackVector2f(reader, &pointTarget);
     }
     else
     {
-        *iter = unpackEntityRef(*iter, &entityTarget);
+        unpackEntityRef(reader, &entityTarget);
     }
 }
 
-Target::Target(vchIter *iter)
+Target::Target(VchReader *reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 Target::Target(vector2f _pointTarget)
 {
@@ -205,33 +203,34 @@ void Entity::pack(vch *dest)
 {
     throw runtime_error("pack() has not been defined for " + getTypeName() + ".");
 }
-void Entity::unpackAndMoveIter(vchIter *iter, Game &game)
+void Entity::unpackAndMoveIter(VchReader *reader, Game &game)
 {
     throw runtime_error("unpackMoveIter() has not been defined for " + getTypeName() + ".");
 }
 void Entity::packEntity(vch *destVch)
 {
-    packToVch(destVch, "C", (unsigned char)dead);
+    VchWriter(destVch).put<uint8_t>((getPackedStateBits() << 1) | (dead ? 1 : 0));
 
     packVector2f(destVch, pos);
 }
-void Entity::unpackEntityAndMoveIter(vchIter *iter)
+void Entity::unpackEntityAndMoveIter(VchReader *reader)
 {
-    unsigned char deadChar;
-    *iter = unpackFromIter(*iter, "C", &deadChar);
-    dead = (bool)deadChar;
+    uint8_t flags = reader->get<uint8_t>();
+    dead = flags & 1;
+    unpackedStateBits = flags >> 1;
 
-    *iter = unpackVector2f(*iter, &pos);
+    unpackVector2f(reader, &pos);
 }
 Entity::Entity(Game *game, EntityRef ref, vector2f pos) : game(game),
                                                           dead(false),
                                                           ref(ref),
-                                                          pos(pos)
+                                                          pos(pos),
+                                                          unpackedStateBits(0)
 {}
-Entity::Entity(Game *game, EntityRef ref, vchIter *iter) : game(game),
+Entity::Entity(Game *game, EntityRef ref, VchReader *reader) : game(game),
                                                            ref(ref)
 {
-    unpackEntityAndMoveIter(iter);
+    unpackEntityAndMoveIter(reader);
 }
 vector2f Entity::getPos()
 {
@@ -258,14 +257,21 @@ vector<Coins*> GoldPile::getDroppableCoins()
 {
     return vector<Coins*>{&gold};
 }
+bool GoldPile::pollChanged()
+{
+    // gold is the only thing about a pile that can change (pos is fixed, and it's removed once it dies)
+    bool changed = gold.getInt() != goldAtLastPoll;
+    goldAtLastPoll = gold.getInt();
+    return changed;
+}
 void GoldPile::pack(vch *dest)
 {
     packEntity(dest);
     gold.pack(dest);
 }
-void GoldPile::unpackAndMoveIter(vchIter *iter)
+void GoldPile::unpackAndMoveIter(VchReader *reader)
 {
-    gold = Coins(iter);
+    gold = Coins(reader);
 }
 sf::Color GoldPile::getTeamColor()
 {
@@ -273,12 +279,14 @@ sf::Color GoldPile::getTeamColor()
 }
 
 GoldPile::GoldPile(Game *game, EntityRef ref, vector2f pos) : Entity(game, ref, pos),
+                                                              goldAtLastPoll(0),
                                                               gold(MAX_COINS)
 {}
-GoldPile::GoldPile(Game *game, EntityRef ref, vchIter *iter) : Entity(game, ref, iter),
+GoldPile::GoldPile(Game *game, EntityRef ref, VchReader *reader) : Entity(game, ref, reader),
                                                                gold(MAX_COINS)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
+    goldAtLastPoll = gold.getInt();
 }
 
 unsigned char GoldPile::typechar() { return GOLDPILE_TYPECHAR; }
@@ -313,30 +321,28 @@ void Unit::packUnit(vch *destVch)
 {
     packEntity(destVch);
 
-    packToVch(destVch, "C", (unsigned char)ownerId);
-    packToVch(destVch, "H", health);
+    VchWriter w(destVch);
+    w.put<uint8_t>(ownerId);
+    w.put<uint16_t>(health);
 
     goldInvested.pack(destVch);
 }
 
-void Unit::unpackUnitAndMoveIter(vchIter *iter)
+void Unit::unpackUnitAndMoveIter(VchReader *reader)
 {
-    unsigned char ownerIdChar;
-    *iter = unpackFromIter(*iter, "C", &ownerIdChar);
-    ownerId = ownerIdChar;
-    
-    *iter = unpackFromIter(*iter, "H", &health);
+    ownerId = reader->get<uint8_t>();
+    health = reader->get<uint16_t>();
 
-    goldInvested = Coins(iter);
+    goldInvested = Coins(reader);
 }
 
 Unit::Unit(Game *game, EntityRef ref, int ownerId, coinsInt totalCost, uint16_t health, vector2f pos)
     : Entity(game, ref, pos), health(health), ownerId(ownerId), goldInvested(totalCost) {}
 
-Unit::Unit(Game *game, EntityRef ref, vchIter *iter) : Entity(game, ref, iter),
+Unit::Unit(Game *game, EntityRef ref, VchReader *reader) : Entity(game, ref, reader),
                                                        goldInvested((coinsInt)0) // will get overwritten in unpack below
 {
-    unpackUnitAndMoveIter(iter);
+    unpackUnitAndMoveIter(reader);
 }
 
 coinsInt Unit::build(coinsInt attemptedAmount, Coins *fromCoins)
@@ -409,15 +415,15 @@ void Building::packBuilding(vch *destVch)
 {
     packUnit(destVch);
 }
-void Building::unpackBuildingAndMoveIter(vchIter *iter)
+void Building::unpackBuildingAndMoveIter(VchReader *reader)
 {
 }
 
 Building::Building(Game *game, uint16_t ref, int ownerId, coinsInt totalCost, uint16_t health, vector2f pos)
     : Unit(game, ref, ownerId, totalCost, health, pos) {}
-Building::Building(Game *game, uint16_t ref, vchIter *iter) : Unit(game, ref, iter)
+Building::Building(Game *game, uint16_t ref, VchReader *reader) : Unit(game, ref, reader)
 {
-    unpackBuildingAndMoveIter(iter);
+    unpackBuildingAndMoveIter(reader);
 }
 
 void Building::buildingGo()
@@ -437,12 +443,12 @@ void MobileUnit::packMobileUnit(vch *dest)
 {
     packUnit(dest);
     target.pack(dest);
-    packToVch(dest, "f", targetRange);
+    VchWriter(dest).putFloat(targetRange);
 }
-void MobileUnit::unpackMobileUnitAndMoveIter(vchIter *iter)
+void MobileUnit::unpackMobileUnitAndMoveIter(VchReader *reader)
 {
-    target = Target(iter);
-    *iter = unpackFromIter(*iter, "f", &targetRange);
+    target = Target(reader);
+    targetRange = reader->getFloat();
 }
 
 MobileUnit::MobileUnit(Game *game, uint16_t ref, int ownerId, coinsInt totalCost, uint16_t health, vector2f pos)
@@ -451,11 +457,11 @@ MobileUnit::MobileUnit(Game *game, uint16_t ref, int ownerId, coinsInt totalCost
     targetRange = 0;
     setTarget(Target(pos), 0);
 }
-MobileUnit::MobileUnit(Game *game, uint16_t ref, vchIter *iter) : Unit(game, ref, iter),
+MobileUnit::MobileUnit(Game *game, uint16_t ref, VchReader *reader) : Unit(game, ref, reader),
                                                                   target(NULL_ENTITYREF),
                                                                   angle_view(0)
 {
-    unpackMobileUnitAndMoveIter(iter);
+    unpackMobileUnitAndMoveIter(reader);
 }
 
 float MobileUnit::getSpeed()
@@ -531,24 +537,22 @@ uint16_t Beacon::getMaxHealth() { return BEACON_HEALTH; }
 
 void Beacon::pack(vch *dest)
 {
-    packBuilding(dest);
-
-    packToVch(dest, "C", (unsigned char)(state));
+    packBuilding(dest); // state goes in the entity flags
 }
-void Beacon::unpackAndMoveIter(vchIter *iter)
+void Beacon::unpackAndMoveIter(VchReader *reader)
 {
-    unsigned char enumInt;
-    *iter = unpackFromIter(*iter, "C", &enumInt);
-    state = static_cast<State>(enumInt);
+    if (unpackedStateBits > Despawning)
+        reader->fail(VchReader::BadEncoding);
+    state = static_cast<State>(unpackedStateBits);
 }
 
 Beacon::Beacon(Game *game, uint16_t ref, int ownerId, vector2f pos, State state)
     : Building(game, ref, ownerId, BEACON_COST, BEACON_HEALTH, pos),
       state(state)
 {}
-Beacon::Beacon(Game *game, uint16_t ref, vchIter *iter) : Building(game, ref, iter)
+Beacon::Beacon(Game *game, uint16_t ref, VchReader *reader) : Building(game, ref, reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 void Beacon::go()
@@ -712,19 +716,17 @@ float Gateway::buildQueueWeight()
 
 void Gateway::pack(vch *dest)
 {
-    packBuilding(dest);
-
-    packToVch(dest, "C", (unsigned char)(state));
+    packBuilding(dest); // state goes in the entity flags
 
     packEntityRef(dest, maybeTargetEntity);
 }
-void Gateway::unpackAndMoveIter(vchIter *iter)
+void Gateway::unpackAndMoveIter(VchReader *reader)
 {
-    unsigned char enumInt;
-    *iter = unpackFromIter(*iter, "C", &enumInt);
-    state = static_cast<State>(enumInt);
+    if (unpackedStateBits > Scuttle)
+        reader->fail(VchReader::BadEncoding);
+    state = static_cast<State>(unpackedStateBits);
 
-    *iter = unpackEntityRef(*iter, &maybeTargetEntity);
+    unpackEntityRef(reader, &maybeTargetEntity);
 }
 
 Gateway::Gateway(Game *game, uint16_t ref, int ownerId, vector2f pos)
@@ -732,9 +734,9 @@ Gateway::Gateway(Game *game, uint16_t ref, int ownerId, vector2f pos)
       state(Idle), goldTransferState(None),
       maybeTargetEntity(NULL_ENTITYREF)
 {}
-Gateway::Gateway(Game *game, uint16_t ref, vchIter *iter) : Building(game, ref, iter)
+Gateway::Gateway(Game *game, uint16_t ref, VchReader *reader) : Building(game, ref, reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 void Gateway::go()
@@ -882,21 +884,19 @@ void Gateway::go()
 
 void Prime::pack(vch *dest)
 {
-    packMobileUnit(dest);
-
-    packToVch(dest, "C", (unsigned char)(state));
+    packMobileUnit(dest); // state goes in the entity flags
 
     heldGold.pack(dest);
     packTypechar(dest, gonnabuildTypechar);
 }
-void Prime::unpackAndMoveIter(vchIter *iter)
+void Prime::unpackAndMoveIter(VchReader *reader)
 {
-    unsigned char enumInt;
-    *iter = unpackFromIter(*iter, "C", &enumInt);
-    state = static_cast<State>(enumInt);
+    if (unpackedStateBits > Build)
+        reader->fail(VchReader::BadEncoding);
+    state = static_cast<State>(unpackedStateBits);
 
-    heldGold = Coins(iter);
-    *iter = unpackTypecharFromIter(*iter, &gonnabuildTypechar);
+    heldGold = Coins(reader);
+    unpackTypecharFromIter(reader, &gonnabuildTypechar);
 }
 
 Prime::Prime(Game *game, uint16_t ref, int ownerId, vector2f pos)
@@ -904,10 +904,10 @@ Prime::Prime(Game *game, uint16_t ref, int ownerId, vector2f pos)
       heldGold(PRIME_MAX_GOLD_HELD),
       state(Idle)
 {}
-Prime::Prime(Game *game, uint16_t ref, vchIter *iter) : MobileUnit(game, ref, iter),
+Prime::Prime(Game *game, uint16_t ref, VchReader *reader) : MobileUnit(game, ref, reader),
                                                         heldGold(PRIME_MAX_GOLD_HELD)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 void Prime::cmdPickup(Target _target)
@@ -1131,28 +1131,26 @@ vector<Coins*> Prime::getDroppableCoins()
 
 void Fighter::pack(vch *dest)
 {
-    packMobileUnit(dest);
+    packMobileUnit(dest); // state goes in the entity flags
 
-    packToVch(dest, "C", (unsigned char)(state));
-    packToVch(dest, "H", shootCooldown);
+    VchWriter(dest).putVarint(shootCooldown);
 }
-void Fighter::unpackAndMoveIter(vchIter *iter)
+void Fighter::unpackAndMoveIter(VchReader *reader)
 {
-    unsigned char enumInt;
-    *iter = unpackFromIter(*iter, "C", &enumInt);
-    state = static_cast<State>(enumInt);
-
-    *iter = unpackFromIter(*iter, "H", &shootCooldown);
+    if (unpackedStateBits > AttackingUnit)
+        reader->fail(VchReader::BadEncoding);
+    state = static_cast<State>(unpackedStateBits);
+    shootCooldown = reader->getVarint<uint16_t>();
 }
 
 Fighter::Fighter(Game *game, EntityRef ref, int ownerId, vector2f pos)
     : MobileUnit(game, ref, ownerId, FIGHTER_COST, FIGHTER_HEALTH, pos),
       state(Idle), shootCooldown(0), animateShot(None), lastShot(None)
 {}
-Fighter::Fighter(Game *game, EntityRef ref, vchIter *iter)
-    : MobileUnit(game, ref, iter)
+Fighter::Fighter(Game *game, EntityRef ref, VchReader *reader)
+    : MobileUnit(game, ref, reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 void Fighter::cmdAttack(EntityRef ref)
@@ -1226,7 +1224,7 @@ string Fighter::getTypename() { return "Fighter"; }
 
 
 
-boost::shared_ptr<Entity> unpackFullEntityAndMoveIter(vchIter *iter, unsigned char typechar, Game *game, EntityRef ref)
+boost::shared_ptr<Entity> unpackFullEntityAndMoveIter(VchReader *reader, unsigned char typechar, Game *game, EntityRef ref)
 {
     switch (typechar)
     {
@@ -1234,20 +1232,52 @@ boost::shared_ptr<Entity> unpackFullEntityAndMoveIter(vchIter *iter, unsigned ch
         return boost::shared_ptr<Entity>();
         break;
     case GOLDPILE_TYPECHAR:
-        return boost::shared_ptr<Entity>(new GoldPile(game, ref, iter));
+        return boost::shared_ptr<Entity>(new GoldPile(game, ref, reader));
+        break;
+    case BEACON_TYPECHAR:
+        return boost::shared_ptr<Entity>(new Beacon(game, ref, reader));
+        break;
+    case GATEWAY_TYPECHAR:
+        return boost::shared_ptr<Entity>(new Gateway(game, ref, reader));
+        break;
+    case PRIME_TYPECHAR:
+        return boost::shared_ptr<Entity>(new Prime(game, ref, reader));
+        break;
+    case FIGHTER_TYPECHAR:
+        return boost::shared_ptr<Entity>(new Fighter(game, ref, reader));
+        break;
+    }
+    reader->fail(VchReader::UnknownTypechar);
+    return boost::shared_ptr<Entity>();
+}
+
+// ------- CLONEENTITY -------
+
+
+
+
+boost::shared_ptr<Entity> cloneMaybeNullEntity(boost::shared_ptr<Entity> entity)
+{
+    switch (getMaybeNullEntityTypechar(entity))
+    {
+    case NULL_TYPECHAR:
+        return boost::shared_ptr<Entity>();
+        break;
+    case GOLDPILE_TYPECHAR:
+        return boost::shared_ptr<Entity>(new GoldPile(*boost::dynamic_pointer_cast<GoldPile, Entity>(entity)));
         break;
     case BEACON_TYPECHAR:
-        return boost::shared_ptr<Entity>(new Beacon(game, ref, iter));
+        return boost::shared_ptr<Entity>(new Beacon(*boost::dynamic_pointer_cast<Beacon, Entity>(entity)));
         break;
     case GATEWAY_TYPECHAR:
-        return boost::shared_ptr<Entity>(new Gateway(game, ref, iter));
+        return boost::shared_ptr<Entity>(new Gateway(*boost::dynamic_pointer_cast<Gateway, Entity>(entity)));
         break;
     case PRIME_TYPECHAR:
-        return boost::shared_ptr<Entity>(new Prime(game, ref, iter));
+        return boost::shared_ptr<Entity>(new Prime(*boost::dynamic_pointer_cast<Prime, Entity>(entity)));
         break;
     case FIGHTER_TYPECHAR:
-        return boost::shared_ptr<Entity>(new Fighter(game, ref, iter));
+        return boost::shared_ptr<Entity>(new Fighter(*boost::dynamic_pointer_cast<Fighter, Entity>(entity)));
         break;
     }
-    throw runtime_error("Trying to unpack an unrecognized entity");
+    throw runtime_error("Trying to clone an unrecognized entity");
 }
\ No newline at end of file
@@ -17,25 +17,31 @@ public:
     virtual unsigned char typechar();
     virtual string getTypeName();
     virtual void pack(vch *dest);
-    virtual void unpackAndMoveIter(vchIter *iter, Game &game);
+    virtual void unpackAndMoveIter(VchReader *reader, Game &game);
     virtual void go();
     virtual sf::Color getTeamColor();
     virtual float getRotation() { return 0; }
     virtual vector<Coins*> getDroppableCoins();
+    virtual bool pollChanged() { return true; } // has anything packed changed since the last poll?
+    // Subclass state that's packed into the spare bits of the entity's flag byte alongside dead (7 bits max).
+    // On unpack it's left in unpackedStateBits for the subclass's unpack to pick up.
+    virtual uint8_t getPackedStateBits() { return 0; }
+    uint8_t unpackedStateBits;
     void die();
 
     bool collidesWithPoint(vector2f);
 
     void packEntity(vch *destVch);
-    void unpackEntityAndMoveIter(vchIter *iter);
+    void unpackEntityAndMoveIter(VchReader *reader);
     Entity(Game *game, EntityRef ref, vector2f pos);
-    Entity(Game *game, EntityRef ref, vchIter *iter);
+    Entity(Game *game, EntityRef ref, VchReader *reader);
 
     vector2f getPos();
 };
 
 unsigned char getMaybeNullEntityTypechar(boost::shared_ptr<Entity>);
-boost::shared_ptr<Entity> unpackFullEntityAndMoveIter(vchIter *iter, unsigned char typechar, Game *game, EntityRef ref);
+boost::shared_ptr<Entity> unpackFullEntityAndMoveIter(VchReader *reader, unsigned char typechar, Game *game, EntityRef ref);
+boost::shared_ptr<Entity> cloneMaybeNullEntity(boost::shared_ptr<Entity> entity);
 enum AllianceType {
     Owned,
     Enemy,
@@ -56,12 +62,12 @@ public:
     } type;
 
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
     Target(vector2f);
     Target(EntityRef);
     Target(boost::shared_ptr<Entity>);
-    Target(vchIter *iter);
+    Target(VchReader *reader);
 
     optional<vector2f> getPointUnlessTargetDeleted(const Game&);
     optional<EntityRef> castToEntityRef();
@@ -71,13 +77,15 @@ public:
 
 class GoldPile : public Entity
 {
+    coinsInt goldAtLastPoll;
 public:
     Coins gold;
     vector<Coins*> getDroppableCoins();
+    bool pollChanged();
     void pack(vch *destVch);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
     GoldPile(Game *, EntityRef, vector2f);
-    GoldPile(Game *, EntityRef, vchIter *);
+    GoldPile(Game *, EntityRef, VchReader *);
     sf::Color getTeamColor();
 
     unsigned char typechar();
@@ -96,9 +104,9 @@ public:
     virtual uint16_t getMaxHealth();
 
     void packUnit(vch *destVch);
-    void unpackUnitAndMoveIter(vchIter *iter);
+    void unpackUnitAndMoveIter(VchReader *reader);
     Unit(Game *, EntityRef, int, coinsInt, uint16_t, vector2f);
-    Unit(Game *, EntityRef, vchIter *);
+    Unit(Game *, EntityRef, VchReader *);
     sf::Color getTeamColor();
 
     coinsInt build(coinsInt attemptedAmount, Coins* fromCoins);
@@ -116,10 +124,10 @@ class Building : public Unit
 {
 public:
     void packBuilding(vch *destVch);
-    void unpackBuildingAndMoveIter(vchIter *iter);
+    void unpackBuildingAndMoveIter(VchReader *reader);
 
     Building(Game *, EntityRef, int, coinsInt, uint16_t, vector2f);
-    Building(Game *, EntityRef, vchIter *);
+    Building(Game *, EntityRef, VchReader *);
 
     void buildingGo();
 };
@@ -146,14 +154,14 @@ public:
     Target getTarget();
 
     void packMobileUnit(vch *destVch);
-    void unpackMobileUnitAndMoveIter(vchIter *iter);
+    void unpackMobileUnitAndMoveIter(VchReader *reader);
 
     void mobileUnitGo();
 
     void cmdMove(vector2f target);
 
     MobileUnit(Game *game, EntityRef ref, int ownerId, coinsInt totalCost, uint16_t, vector2f pos);
-    MobileUnit(Game *game, EntityRef ref, vchIter *iter);
+    MobileUnit(Game *game, EntityRef ref, VchReader *reader);
 };
 
 class Beacon : public Building
@@ -164,11 +172,12 @@ public:
         Despawning
     } state;
 
+    uint8_t getPackedStateBits() { return state; }
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
     Beacon(Game *game, EntityRef ref, int ownerId, vector2f pos, State state);
-    Beacon(Game *game, EntityRef ref, vchIter *iter);
+    Beacon(Game *game, EntityRef ref, VchReader *reader);
 
     unsigned char typechar();
     string getTypeName();
@@ -194,11 +203,12 @@ public:
 
     EntityRef maybeTargetEntity;
 
+    uint8_t getPackedStateBits() { return state; }
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
     Gateway(Game *game, EntityRef ref, int ownerId, vector2f pos);
-    Gateway(Game *game, EntityRef ref, vchIter *iter);
+    Gateway(Game *game, EntityRef ref, VchReader *reader);
 
     void cmdBuildUnit(unsigned char unitTypechar);
     void cmdDepositTo(Target target);
@@ -238,11 +248,12 @@ public:
     float getRange();
     void onMoveCmd(vector2f moveTo);
 
+    uint8_t getPackedStateBits() { return state; }
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
     Prime(Game *game, EntityRef ref, int ownerId, vector2f pos);
-    Prime(Game *game, EntityRef ref, vchIter *iter);
+    Prime(Game *game, EntityRef ref, VchReader *reader);
 
     void cmdPickup(Target);
     void cmdPutdown(Target);
@@ -280,11 +291,12 @@ public:
     float getRange();
     void onMoveCmd(vector2f moveTo);
 
+    uint8_t getPackedStateBits() { return state; }
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
     Fighter(Game *game, EntityRef ref, int ownerId, vector2f pos);
-    Fighter(Game *game, EntityRef ref, vchIter *iter);
+    Fighter(Game *game, EntityRef ref, VchReader *reader);
 
     void cmdAttack(EntityRef ref);
 
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <climits>
 #include <boost/shared_ptr.hpp>
 #include "events.h"
 #include "common.h"
@@ -7,21 +8,22 @@
 
 using namespace std;
 
-boost::shared_ptr<Event> unpackFullEventAndMoveIter(vchIter *iter)
+boost::shared_ptr<Event> unpackFullEventAndMoveIter(VchReader *reader)
 {
     unsigned char typechar;
-    *iter = unpackTypecharFromIter(*iter, &typechar);
+    unpackTypecharFromIter(reader, &typechar);
 
     switch (typechar)
     {
     case NULL_TYPECHAR:
         return boost::shared_ptr<Event>();
     case EVENT_BALANCEUPDATE_CHAR:
-        return boost::shared_ptr<Event>(new BalanceUpdateEvent(iter));
+        return boost::shared_ptr<Event>(new BalanceUpdateEvent(reader));
     case EVENT_HONEYPOT_CHAR:
-        return boost::shared_ptr<Event>(new HoneypotAddedEvent(iter));
+        return boost::shared_ptr<Event>(new HoneypotAddedEvent(reader));
     }
-    throw runtime_error("Trying to unpack an unrecognized event");
+    reader->fail(VchReader::UnknownTypechar);
+    return boost::shared_ptr<Event>();
 }
 
 unsigned char Event::typechar()
@@ -32,7 +34,7 @@ void Event::pack(vch *dest)
 {
     throw runtime_error("pack() has not been defined for an event.");
 }
-void Event::unpackAndMoveIter(vchIter *iter)
+void Event::unpackAndMoveIter(VchReader *reader)
 {
     throw runtime_error("unpackAndMoveIter() has not been defined for an event.");
 }
@@ -43,13 +45,13 @@ void Event::execute(Game *game)
 
 void Event::packEvent(vch *dest) {}
 
-void Event::unpackEventAndMoveIter(vchIter *iter) {}
+void Event::unpackEventAndMoveIter(VchReader *reader) {}
 
 Event::Event() {}
 
-Event::Event(vchIter *iter)
+Event::Event(VchReader *reader)
 {
-    unpackEventAndMoveIter(iter);
+    unpackEventAndMoveIter(reader);
 }
 
 unsigned char BalanceUpdateEvent::typechar()
@@ -58,10 +60,18 @@ unsigned char BalanceUpdateEvent::typechar()
 }
 void BalanceUpdateEvent::execute(Game *game)
 {
+    if (playerIdOrNegativeOne >= (int)game->players.size())
+    {
+        cout << "Woah, got a BalanceUpdateEvent for a player that doesn't exist!" << endl;
+        return;
+    }
+
     if (isDeposit)
     {
         // see if player exists for this address
-        int playerId = game->playerAddressToIdOrNegativeOne(userAddress);
+        int playerId = playerIdOrNegativeOne;
+        if (playerId == -1)
+            playerId = game->playerAddressToIdOrNegativeOne(userAddress);
 
         // if no user for this address, create one
         if (playerId == -1)
@@ -74,7 +84,9 @@ void BalanceUpdateEvent::execute(Game *game)
     }
     else
     {
-        int playerId = game->playerAddressToIdOrNegativeOne(userAddress);
+        int playerId = playerIdOrNegativeOne;
+        if (playerId == -1)
+            playerId = game->playerAddressToIdOrNegativeOne(userAddress);
 
         if (playerId == -1)
         {
@@ -89,28 +101,48 @@ void BalanceUpdateEvent::pack(vch *dest)
 {
     packEvent(dest);
 
-    packStringToVch(dest, userAddress);
-    packToVch(dest, "L", amount);
-    packToVch(dest, "C", (unsigned char)isDeposit);
+    VchWriter w(dest);
+    // 0 means a new address follows; otherwise it's the player index + 1
+    w.putVarint(playerIdOrNegativeOne + 1);
+    if (playerIdOrNegativeOne == -1)
+    {
+        packStringToVch(dest, userAddress);
+    }
+    // isDeposit rides in the low bit of the amount
+    w.putVarint(((uint64_t)amount << 1) | (isDeposit ? 1 : 0));
 }
-void BalanceUpdateEvent::unpackAndMoveIter(vchIter *iter)
-{
-    *iter = unpackStringFromIter(*iter, 50, &userAddress);
-    cout << "userAddress after unpack: " << userAddress << endl;
-    *iter = unpackFromIter(*iter, "L", &amount);
-    unsigned char isDepositBoolChar;
-    *iter = unpackFromIter(*iter, "C", &isDepositBoolChar);
-    isDeposit = (bool)isDepositBoolChar;
+void BalanceUpdateEvent::unpackAndMoveIter(VchReader *reader)
+{
+    // as wide as it was packed; anything that wouldn't fit in playerIdOrNegativeOne can't be a player
+    uint32_t playerIdPlusOne = reader->getVarint<uint32_t>();
+    if (playerIdPlusOne > INT_MAX)
+        reader->fail(VchReader::ValueTooBig);
+    playerIdOrNegativeOne = reader->ok() ? (int)playerIdPlusOne - 1 : -1;
+    if (playerIdOrNegativeOne == -1)
+    {
+        unpackStringFromIter(reader, 50, &userAddress);
+    }
+    uint64_t amountAndIsDeposit = reader->getVarint<uint64_t>();
+    if ((amountAndIsDeposit >> 1) > MAX_COINS)
+        reader->fail(VchReader::ValueTooBig);
+    amount = amountAndIsDeposit >> 1;
+    isDeposit = amountAndIsDeposit & 1;
 }
 
-BalanceUpdateEvent::BalanceUpdateEvent(string userAddress, coinsInt amount, bool isDeposit)
+BalanceUpdateEvent::BalanceUpdateEvent(Game *game, string userAddress, coinsInt amount, bool isDeposit)
     : Event(),
-      userAddress(userAddress), amount(amount), isDeposit(isDeposit) {}
+      playerIdOrNegativeOne(game->playerAddressToIdOrNegativeOne(userAddress)), amount(amount), isDeposit(isDeposit)
+{
+    if (playerIdOrNegativeOne == -1)
+    {
+        this->userAddress = userAddress;
+    }
+}
 
-BalanceUpdateEvent::BalanceUpdateEvent(vchIter *iter)
-    : Event(iter)
+BalanceUpdateEvent::BalanceUpdateEvent(VchReader *reader)
+    : Event(reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
 
 unsigned char HoneypotAddedEvent::typechar()
@@ -136,19 +168,19 @@ void HoneypotAddedEvent::execute(Game *game)
 
 void HoneypotAddedEvent::pack(vch *dest)
 {
-    packToVch(dest, "L", honeypotAmount);
+    VchWriter(dest).putVarint(honeypotAmount);
     packEvent(dest);
 }
-void HoneypotAddedEvent::unpackAndMoveIter(vchIter *iter)
+void HoneypotAddedEvent::unpackAndMoveIter(VchReader *reader)
 {
-    *iter = unpackFromIter(*iter, "L", &honeypotAmount);
+    honeypotAmount = reader->getVarint<uint32_t>();
 }
 
 HoneypotAddedEvent::HoneypotAddedEvent(coinsInt honeypotAmount)
     : Event(), honeypotAmount(honeypotAmount)
     {}
-HoneypotAddedEvent::HoneypotAddedEvent(vchIter *iter)
-    : Event(iter)
+HoneypotAddedEvent::HoneypotAddedEvent(VchReader *reader)
+    : Event(reader)
 {
-    unpackAndMoveIter(iter);
+    unpackAndMoveIter(reader);
 }
\ No newline at end of file
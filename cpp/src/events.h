@@ -13,25 +13,28 @@ const unsigned char EVENT_HONEYPOT_CHAR = 2;
 
 struct Event;
 
-boost::shared_ptr<Event> unpackFullEventAndMoveIter(vchIter *iter);
+boost::shared_ptr<Event> unpackFullEventAndMoveIter(VchReader *reader);
 
 struct Event
 {
     virtual unsigned char typechar();
     virtual void pack(vch *dest);
-    virtual void unpackAndMoveIter(vchIter *iter);
+    virtual void unpackAndMoveIter(VchReader *reader);
     virtual void execute(Game *game);
 
     void packEvent(vch *dest);
-    void unpackEventAndMoveIter(vchIter *iter);
+    void unpackEventAndMoveIter(VchReader *reader);
 
     Event();
-    Event(vchIter *iter);
+    Event(VchReader *reader);
 };
 
+// An existing player is referred to by index. Only an address the game doesn't have a player for
+// yet goes out in full; executing the event then adds that player at the end of game->players.
 struct BalanceUpdateEvent : public Event
 {
-    string userAddress;
+    int playerIdOrNegativeOne;
+    string userAddress; // only set if playerIdOrNegativeOne is -1
     coinsInt amount;
     bool isDeposit;
 
@@ -40,10 +43,11 @@ struct BalanceUpdateEvent : public Event
     void execute(Game *game);
 
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
-    BalanceUpdateEvent(string userAddress, coinsInt amount, bool isDeposit);
-    BalanceUpdateEvent(vchIter *iter);
+    // game is only read, to look up the address; the event is executed later
+    BalanceUpdateEvent(Game *game, string userAddress, coinsInt amount, bool isDeposit);
+    BalanceUpdateEvent(VchReader *reader);
 };
 
 struct HoneypotAddedEvent : public Event
@@ -55,10 +59,10 @@ struct HoneypotAddedEvent : public Event
     void execute(Game *game);
 
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
 
     HoneypotAddedEvent(coinsInt honeypotAmount);
-    HoneypotAddedEvent(vchIter *iter);
+    HoneypotAddedEvent(VchReader *reader);
 };
 
 #endif // EVENTS_H
\ No newline at end of file
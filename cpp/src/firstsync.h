@@ -0,0 +1,35 @@
+#ifndef FIRSTSYNC_H
+#define FIRSTSYNC_H
+
+#include <cstdint>
+
+// How the tick brings a channel that's ReadyForFirstSync into sync: a new client, one that's reconnected, or a
+// laggard whose queue was dropped.
+enum FirstSyncAction
+{
+    CatchUpFromHistory, // replay the frames it missed, from its baseline on
+    WaitForBaseline,    // nothing yet; see planFirstSync
+    ResyncFromBaseline  // a resync at the frame we're on: a delta from resyncBaseline, or a full one if that's 0
+};
+struct FirstSyncPlan
+{
+    FirstSyncAction action;
+    uint64_t resyncBaseline;
+};
+
+// clientBaselineFrame is the frame the client's game will be at when it gets to whatever we send next (0 if it
+// has none), and historyCoversBaseline whether the frame history can replay everything from there. With input
+// delay, that baseline can be up to the delay past gameFrame, the frame we're on: the client's been sent frames
+// we haven't run yet. A resync at gameFrame would then land in the middle of frames it already has, so we wait
+// until we get to its baseline and send a delta from there. A baseline past scheduledEnd (one past the last
+// frame scheduled) isn't from this server's game, so that gets a full resync.
+inline FirstSyncPlan planFirstSync(uint64_t clientBaselineFrame, bool historyCoversBaseline, uint64_t gameFrame, uint64_t scheduledEnd)
+{
+    if (clientBaselineFrame != 0 && historyCoversBaseline)
+        return {CatchUpFromHistory, 0};
+    if (clientBaselineFrame > gameFrame && clientBaselineFrame <= scheduledEnd)
+        return {WaitForBaseline, 0};
+    return {ResyncFromBaseline, clientBaselineFrame <= gameFrame ? clientBaselineFrame : 0};
+}
+
+#endif // FIRSTSYNC_H
@@ -0,0 +1,115 @@
+#ifndef HANDLERALLOC_H
+#define HANDLERALLOC_H
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// A few blocks of memory for asio to keep handlers (and the ops wrapping them) in, reused instead of going to
+// the heap every time. Meant for something a connection does over and over, a bit at a time: its writes, or
+// the frame the tick posts it every tick. Each of those takes a couple of blocks at once (the op, then the
+// strand's own), hence NUM_SLOTS. Anything too big, or past what's free, just falls back on the heap.
+// Allocating and freeing can happen on different threads.
+//
+// Hand it to asio by wrapping the handler with makeCustomAllocHandler; asio allocates anything it keeps for the
+// handler through its allocator. After asio's allocation example.
+class HandlerMemory
+{
+    static const unsigned int NUM_SLOTS = 3;
+
+    std::size_t slotSize;
+    unsigned char *storage;
+    std::atomic<unsigned int> slotsInUse; // a bit per slot
+
+public:
+    explicit HandlerMemory(std::size_t slotSize)
+        : slotSize((slotSize + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t)),
+          slotsInUse(0)
+    {
+        storage = static_cast<unsigned char *>(::operator new(this->slotSize * NUM_SLOTS));
+    }
+    ~HandlerMemory()
+    {
+        ::operator delete(storage);
+    }
+    HandlerMemory(const HandlerMemory &) = delete;
+    HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+    void *allocate(std::size_t size)
+    {
+        if (size <= slotSize)
+        {
+            unsigned int inUse = slotsInUse.load(std::memory_order_relaxed);
+            unsigned int free;
+            while ((free = ~inUse & ((1u << NUM_SLOTS) - 1)) != 0)
+            {
+                unsigned int slot = __builtin_ctz(free);
+                if (slotsInUse.compare_exchange_weak(inUse, inUse | (1u << slot), std::memory_order_acquire, std::memory_order_relaxed))
+                    return storage + slot * slotSize;
+            }
+        }
+        return ::operator new(size);
+    }
+    void deallocate(void *pointer)
+    {
+        unsigned char *p = static_cast<unsigned char *>(pointer);
+        if (p >= storage && p < storage + slotSize * NUM_SLOTS)
+            slotsInUse.fetch_and(~(1u << ((p - storage) / slotSize)), std::memory_order_release);
+        else
+            ::operator delete(pointer);
+    }
+};
+
+template<typename T> class HandlerAllocator
+{
+    template<typename> friend class HandlerAllocator;
+    HandlerMemory *memory;
+
+public:
+    typedef T value_type;
+
+    explicit HandlerAllocator(HandlerMemory &memory) : memory(&memory) {}
+    template<typename U> HandlerAllocator(const HandlerAllocator<U> &other) noexcept : memory(other.memory) {}
+
+    bool operator==(const HandlerAllocator &other) const noexcept { return memory == other.memory; }
+    bool operator!=(const HandlerAllocator &other) const noexcept { return memory != other.memory; }
+
+    T *allocate(std::size_t n) const
+    {
+        return static_cast<T *>(memory->allocate(sizeof(T) * n));
+    }
+    void deallocate(T *pointer, std::size_t) const
+    {
+        memory->deallocate(pointer);
+    }
+};
+
+template<typename Handler> class CustomAllocHandler
+{
+    HandlerMemory *memory;
+    Handler handler;
+
+public:
+    typedef HandlerAllocator<Handler> allocator_type;
+
+    CustomAllocHandler(HandlerMemory &memory, Handler handler) : memory(&memory), handler(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept
+    {
+        return allocator_type(*memory);
+    }
+
+    template<typename ...Args> void operator()(Args &&...args)
+    {
+        handler(std::forward<Args>(args)...);
+    }
+};
+
+template<typename Handler> CustomAllocHandler<typename std::decay<Handler>::type> makeCustomAllocHandler(HandlerMemory &memory, Handler &&handler)
+{
+    return CustomAllocHandler<typename std::decay<Handler>::type>(memory, std::forward<Handler>(handler));
+}
+
+#endif // HANDLERALLOC_H
@@ -0,0 +1,100 @@
+#ifndef JITTERBUFFER_H
+#define JITTERBUFFER_H
+
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include "config.h"
+
+// The frames the client's been sent but hasn't run yet, oldest first. They're kept in a ring that doubles when it
+// fills up, so taking one off the front doesn't shift the rest along however far behind we are.
+//
+// The server sends frames the input delay ahead of its game, so that's how many we aim to have in hand besides the
+// one we're about to run: the target depth. Normally we run one frame per tick interval. A hitch or a stall leaves
+// us holding more, and past JITTER_BUFFER_SLACK over the target we run extra frames each tick until we're back down
+// to it (see framesToRun), so a client that's fallen behind gets back to real time on its own.
+template<typename T> class JitterBuffer
+{
+    std::vector<std::optional<T>> slots; // a power of 2 of them
+    size_t first; // slot of the oldest
+    size_t count;
+    bool catchingUp;
+
+    void grow()
+    {
+        std::vector<std::optional<T>> grown(slots.size() * 2);
+        for (size_t i = 0; i < count; i++)
+        {
+            grown[i] = std::move(slots[(first + i) & (slots.size() - 1)]);
+        }
+        slots.swap(grown);
+        first = 0;
+    }
+
+public:
+    JitterBuffer()
+        : slots(64), first(0), count(0), catchingUp(false) {}
+
+    size_t size() const
+    {
+        return count;
+    }
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    void push(T value)
+    {
+        if (count == slots.size())
+            grow();
+
+        slots[(first + count) & (slots.size() - 1)] = std::move(value);
+        count++;
+    }
+
+    // only if there's one
+    T &front()
+    {
+        return *slots[first];
+    }
+    void pop()
+    {
+        slots[first].reset();
+        first = (first + 1) & (slots.size() - 1);
+        count--;
+    }
+
+    void clear()
+    {
+        while (count > 0)
+        {
+            pop();
+        }
+        catchingUp = false;
+    }
+
+    // How many frames to run this tick: one, or none if we've got none. While catching up, one more per
+    // JITTER_BUFFER_CATCHUP_DIVISOR frames over the target, up to JITTER_BUFFER_MAX_EXTRA_FRAMES more, so we
+    // come back quickly when we're well behind and ease off as we get close.
+    unsigned int framesToRun(unsigned int targetDepth)
+    {
+        if (count == 0)
+            return 0;
+
+        size_t inHand = count - 1;
+        if (inHand > targetDepth + JITTER_BUFFER_SLACK)
+            catchingUp = true;
+        else if (inHand <= targetDepth)
+            catchingUp = false;
+
+        if (!catchingUp)
+            return 1;
+
+        size_t excess = inHand - targetDepth;
+        size_t extra = (excess + JITTER_BUFFER_CATCHUP_DIVISOR - 1) / JITTER_BUFFER_CATCHUP_DIVISOR;
+        return 1 + std::min(extra, (size_t)JITTER_BUFFER_MAX_EXTRA_FRAMES);
+    }
+};
+
+#endif // JITTERBUFFER_H
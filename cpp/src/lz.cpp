@@ -0,0 +1,168 @@
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include "lz.h"
+
+using namespace std;
+
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_MAX_OFFSET = 65535;
+const unsigned int LZ_HASH_BITS = 14;
+
+uint32_t lzRead32(const unsigned char *p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+uint32_t lzHash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+void lzPutLength(vector<unsigned char> *dest, size_t length)
+{
+    while (length >= 255)
+    {
+        dest->push_back(255);
+        length -= 255;
+    }
+    dest->push_back((unsigned char)length);
+}
+
+// Literals, then (unless it's the last sequence) a match at offset back from the end of the literals.
+void lzPutSequence(vector<unsigned char> *dest, const unsigned char *literals, size_t numLiterals, size_t offset, size_t matchLength, bool last)
+{
+    size_t matchNibble = last ? 0 : matchLength - LZ_MIN_MATCH;
+
+    dest->push_back((unsigned char)((min(numLiterals, (size_t)15) << 4) | min(matchNibble, (size_t)15)));
+    if (numLiterals >= 15)
+        lzPutLength(dest, numLiterals - 15);
+
+    dest->insert(dest->end(), literals, literals + numLiterals);
+
+    if (last)
+        return;
+
+    dest->push_back((unsigned char)(offset & 0xff));
+    dest->push_back((unsigned char)(offset >> 8));
+    if (matchNibble >= 15)
+        lzPutLength(dest, matchNibble - 15);
+}
+
+void lzCompress(const unsigned char *src, size_t srcSize, vector<unsigned char> *dest)
+{
+    // worst case, for input with no matches at all
+    dest->reserve(dest->size() + srcSize + srcSize / 255 + 16);
+
+    // positions + 1, so 0 can mean empty
+    vector<uint32_t> table(1 << LZ_HASH_BITS, 0);
+
+    size_t anchor = 0; // start of the literals not yet written
+    size_t pos = 0;
+
+    while (pos + LZ_MIN_MATCH <= srcSize)
+    {
+        uint32_t sequence = lzRead32(src + pos);
+        uint32_t hash = lzHash(sequence);
+        size_t candidate = table[hash];
+        table[hash] = pos + 1;
+
+        if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET || lzRead32(src + candidate - 1) != sequence)
+        {
+            // the longer we go without a match, the faster we skip ahead; incompressible data costs less this way
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        size_t matchStart = candidate - 1;
+        size_t matchLength = LZ_MIN_MATCH;
+        while (pos + matchLength < srcSize && src[matchStart + matchLength] == src[pos + matchLength])
+        {
+            matchLength++;
+        }
+
+        lzPutSequence(dest, src + anchor, pos - anchor, pos - matchStart, matchLength, false);
+
+        pos += matchLength;
+        anchor = pos;
+    }
+
+    lzPutSequence(dest, src + anchor, srcSize - anchor, 0, 0, true);
+}
+
+// false if it runs off the end of the input or past maxLength
+bool lzGetLength(const unsigned char **in, const unsigned char *inEnd, size_t maxLength, size_t *length)
+{
+    while (true)
+    {
+        if (*in >= inEnd)
+            return false;
+
+        unsigned char byte = *((*in)++);
+        *length += byte;
+        if (*length > maxLength)
+            return false;
+        if (byte != 255)
+            return true;
+    }
+}
+
+bool lzDecompress(const unsigned char *src, size_t srcSize, unsigned char *dest, size_t destSize)
+{
+    const unsigned char *in = src;
+    const unsigned char *inEnd = src + srcSize;
+    unsigned char *out = dest;
+    unsigned char *outEnd = dest + destSize;
+
+    while (in < inEnd)
+    {
+        unsigned char token = *(in++);
+
+        size_t numLiterals = token >> 4;
+        if (numLiterals == 15 && !lzGetLength(&in, inEnd, destSize, &numLiterals))
+            return false;
+        if (numLiterals > (size_t)(inEnd - in) || numLiterals > (size_t)(outEnd - out))
+            return false;
+
+        memcpy(out, in, numLiterals);
+        in += numLiterals;
+        out += numLiterals;
+
+        // the last sequence has no match
+        if (in == inEnd)
+            break;
+
+        if (inEnd - in < 2)
+            return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > (size_t)(out - dest))
+            return false;
+
+        size_t matchLength = token & 0x0f;
+        if (matchLength == 15 && !lzGetLength(&in, inEnd, destSize, &matchLength))
+            return false;
+        matchLength += LZ_MIN_MATCH;
+        if (matchLength > (size_t)(outEnd - out))
+            return false;
+
+        const unsigned char *match = out - offset;
+        if (offset >= matchLength)
+        {
+            memcpy(out, match, matchLength);
+            out += matchLength;
+        }
+        else
+        {
+            // overlaps what it's writing, which is how runs get encoded; has to go a byte at a time
+            for (size_t i = 0; i < matchLength; i++)
+            {
+                *(out++) = *(match++);
+            }
+        }
+    }
+
+    return out == outEnd;
+}
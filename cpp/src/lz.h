@@ -0,0 +1,25 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <vector>
+
+// A small, fast LZ77 compressor using the LZ4 block format: a run of sequences, each
+//     token                 high nibble literal length, low nibble match length - 4 (15 = more follows)
+//     [extra literal length bytes]  255 each until one that isn't
+//     literals
+//     offset                2 bytes, little-endian; how far back the match starts
+//     [extra match length bytes]
+// The last sequence is literals only and ends with the input.
+//
+// It only finds matches through a single hash table probe, so it's a good deal faster than it is thorough,
+// which is the right tradeoff for packets that are compressed once and sent right away.
+
+// Appends the compressed form of src to dest.
+void lzCompress(const unsigned char *src, size_t srcSize, std::vector<unsigned char> *dest);
+
+// Decompresses into exactly destSize bytes. Returns false if src is malformed or doesn't decompress to exactly
+// destSize bytes; never reads or writes out of bounds either way.
+bool lzDecompress(const unsigned char *src, size_t srcSize, unsigned char *dest, size_t destSize);
+
+#endif // LZ_H
@@ -0,0 +1,65 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free queue for any number of producer threads and one consumer (Vyukov's). A push is one
+// atomic exchange and never waits on the consumer or on other producers.
+//
+// A push is only visible once the producer's linked its node in, so a pop racing a push can come up empty
+// even though the push has started; whatever it missed turns up on a later pop. That's fine for queues that
+// are drained once a tick.
+template<typename T> class MpscQueue
+{
+    struct Node
+    {
+        std::atomic<Node *> next;
+        T value;
+
+        Node() : next(nullptr) {}
+        Node(T &&value) : next(nullptr), value(std::move(value)) {}
+    };
+
+    std::atomic<Node *> head; // most recently pushed; producers swap themselves in here
+    Node *tail;               // consumer only; a spent node whose next is the oldest unpopped value
+
+public:
+    MpscQueue()
+    {
+        Node *stub = new Node;
+        head.store(stub);
+        tail = stub;
+    }
+    ~MpscQueue()
+    {
+        T discarded;
+        while (pop(&discarded)) {}
+        delete tail;
+    }
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    // any thread
+    void push(T value)
+    {
+        Node *node = new Node(std::move(value));
+        Node *prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // consumer thread only. Returns false if there's nothing (yet) to pop.
+    bool pop(T *dest)
+    {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (!next)
+            return false;
+
+        *dest = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+};
+
+#endif // MPSCQUEUE_H
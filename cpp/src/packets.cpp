@@ -1,5 +1,6 @@
 #include "packets.h"
 #include "events.h"
+#include "lz.h"
 
 unsigned char Packet::typechar()
 {
@@ -10,33 +11,102 @@ void Packet::pack(vch *dest)
 {
     throw runtime_error("pack() has not been defined for a packet");
 }
-void Packet::unpackAndMoveIter(vchIter *iter)
+void Packet::unpackAndMoveIter(VchReader *reader)
 {
     throw runtime_error("unpackMoveIter() has not been defined for a packet");
 }
 
 void Packet::packPacket(vch *destVch) {}
-void Packet::unpackPacketAndMoveIter(vchIter *iter) {}
+void Packet::unpackPacketAndMoveIter(VchReader *reader) {}
 
 Packet::Packet() {}
-Packet::Packet(vchIter *iter)
+Packet::Packet(VchReader *reader)
 {
-    unpackPacketAndMoveIter(iter);
+    unpackPacketAndMoveIter(reader);
+}
+
+bool compressPacketBody(const vch &body, vch *dest)
+{
+    if (body.size() < PACKET_COMPRESSION_THRESHOLD)
+        return false;
+
+    dest->clear();
+    VchWriter(dest).putVarint(body.size());
+    lzCompress(body.data(), body.size(), dest);
+
+    return dest->size() < body.size();
+}
+bool decompressPacketBody(const unsigned char *compressed, size_t compressedSize, vch *dest)
+{
+    VchReader reader(compressed, compressedSize);
+    uint64_t size = reader.getVarint();
+    if (!reader.ok() || size > MAX_DECOMPRESSED_PACKET_SIZE)
+        return false;
+
+    size_t headerSize = compressedSize - reader.remaining();
+
+    // resize rather than reallocate, so the buffer's capacity carries over from packet to packet
+    dest->resize(size);
+    return lzDecompress(compressed + headerSize, reader.remaining(), dest->data(), size);
+}
+
+PackedPacket::PackedPacket(unsigned char typechar, vch body, bool compress)
+    : body(std::move(body))
+{
+    vch compressed;
+    if (compress && compressPacketBody(this->body, &compressed))
+    {
+        this->body.swap(compressed);
+        typechar |= PACKET_COMPRESSED_FLAG;
+    }
+
+    VchWriter w(&header);
+    w.reserve(1 + 8);
+    w.put<uint8_t>(typechar);
+    w.put<uint64_t>(this->body.size());
+}
+unsigned char PackedPacket::typechar() const
+{
+    return header[0];
+}
+size_t PackedPacket::size() const
+{
+    return header.size() + body.size();
+}
+std::array<boost::asio::const_buffer, 2> PackedPacket::asBuffers() const
+{
+    return {boost::asio::buffer(header), boost::asio::buffer(body)};
 }
 
 unsigned char FrameEventsPacket::typechar()
 {
     return PACKET_FRAMECMDS_CHAR;
 }
+bool FrameEventsPacket::isEmpty()
+{
+    return authdCmds.size() == 0 && events.size() == 0;
+}
 void FrameEventsPacket::pack(vch *dest)
 {
     packPacket(dest);
 
-    packToVch(dest, "QCC", frame, (unsigned char)(authdCmds.size()), (unsigned char)(events.size()));
+    VchWriter(dest).putVarint(frame);
+    packContents(dest);
+}
+void FrameEventsPacket::unpackAndMoveIter(VchReader *reader)
+{
+    frame = reader->getVarint();
+    unpackContentsAndMoveIter(reader);
+}
+void FrameEventsPacket::packContents(vch *dest)
+{
+    VchWriter w(dest);
+    w.putVarint(authdCmds.size());
+    w.putVarint(events.size());
 
     for (unsigned int i = 0; i < authdCmds.size(); i++)
     {
-        packStringToVch(dest, authdCmds[i]->playerAddress);
+        w.putVarint(authdCmds[i]->playerId);
         packTypechar(dest, authdCmds[i]->cmd->getTypechar());
         authdCmds[i]->cmd->pack(dest);
     }
@@ -48,32 +118,280 @@ void FrameEventsPacket::pack(vch *dest)
     }
 }
 
-void FrameEventsPacket::unpackAndMoveIter(vchIter *iter)
+void FrameEventsPacket::unpackContentsAndMoveIter(VchReader *reader)
 {
-    unsigned char numCmds, numEvents;
-    *iter = unpackFromIter(*iter, "QCC", &frame, &numCmds, &numEvents);
+    uint32_t numCmds = reader->getCount();
+    uint32_t numEvents = reader->getCount();
 
     authdCmds.clear();
-    for (unsigned int i = 0; i < numCmds; i++)
+    for (unsigned int i = 0; i < numCmds && reader->ok(); i++)
     {
-        string playerAddress;
-        *iter = unpackStringFromIter(*iter, 42, &playerAddress);
-        boost::shared_ptr<Cmd> unauthdCmd = unpackFullCmdAndMoveIter(iter);
+        uint32_t playerId = reader->getVarint<uint32_t>();
+        boost::shared_ptr<Cmd> unauthdCmd = unpackFullCmdAndMoveIter(reader);
 
-        authdCmds.push_back(boost::shared_ptr<AuthdCmd>(new AuthdCmd(unauthdCmd, playerAddress)));
+        authdCmds.push_back(boost::shared_ptr<AuthdCmd>(new AuthdCmd(unauthdCmd, playerId)));
     }
 
     events.clear();
-    for (unsigned int i = 0; i < numEvents; i++)
+    for (unsigned int i = 0; i < numEvents && reader->ok(); i++)
     {
-        events.push_back(unpackFullEventAndMoveIter(iter));
+        events.push_back(unpackFullEventAndMoveIter(reader));
     }
 }
 
+void FrameEventsPacket::packBatchEntry(vch *dest)
+{
+    VchWriter(dest).putVarint(1);
+    packContents(dest);
+}
+
 FrameEventsPacket::FrameEventsPacket(uint64_t frame, vector<boost::shared_ptr<AuthdCmd>> authdCmds, vector<boost::shared_ptr<Event>> events)
     : frame(frame), authdCmds(authdCmds), events(events) {}
 
-FrameEventsPacket::FrameEventsPacket(vchIter *iter)
+FrameEventsPacket::FrameEventsPacket(VchReader *reader)
+{
+    unpackAndMoveIter(reader);
+}
+
+PackedFrameBatch::PackedFrameBatch(uint64_t firstFrame, const vector<boost::shared_ptr<const vch>> &frameEntries)
+{
+    // Lay out the per-channel bytes first, noting where each shared entry falls between them;
+    // nothing can point into framing until it's done growing.
+    vector<size_t> framingBeforeEntry;
+    uint64_t emptyRun = 0;
+    size_t bodySize = 0;
+
+    VchWriter w(&framing);
+    w.putVarint(firstFrame);
+    for (unsigned int i = 0; i < frameEntries.size(); i++)
+    {
+        if (!frameEntries[i])
+        {
+            emptyRun++;
+            continue;
+        }
+
+        if (emptyRun > 0)
+        {
+            w.putVarint(emptyRun << 1);
+            emptyRun = 0;
+        }
+        framingBeforeEntry.push_back(framing.size());
+        entries.push_back(frameEntries[i]);
+        bodySize += frameEntries[i]->size();
+    }
+    if (emptyRun > 0)
+    {
+        w.putVarint(emptyRun << 1);
+    }
+    bodySize += framing.size();
+
+    VchWriter h(&header);
+    h.put<uint8_t>(PACKET_FRAMEBATCH_CHAR);
+    h.put<uint64_t>(bodySize);
+
+    buffers.reserve(2 + 2 * entries.size());
+    buffers.push_back(boost::asio::buffer(header));
+    size_t framingSent = 0;
+    for (unsigned int i = 0; i < entries.size(); i++)
+    {
+        if (framingBeforeEntry[i] > framingSent)
+        {
+            buffers.push_back(boost::asio::buffer(framing.data() + framingSent, framingBeforeEntry[i] - framingSent));
+            framingSent = framingBeforeEntry[i];
+        }
+        buffers.push_back(boost::asio::buffer(*entries[i]));
+    }
+    if (framing.size() > framingSent)
+    {
+        buffers.push_back(boost::asio::buffer(framing.data() + framingSent, framing.size() - framingSent));
+    }
+
+    if (bodySize >= PACKET_COMPRESSION_THRESHOLD)
+    {
+        compressFlattened();
+    }
+}
+// Copies the body out into one vch and compresses it, if that makes it smaller.
+void PackedFrameBatch::compressFlattened()
 {
-    unpackAndMoveIter(iter);
+    vch flat;
+    flat.reserve(size());
+    for (unsigned int i = 1; i < buffers.size(); i++) // buffers[0] is the header
+    {
+        const unsigned char *data = (const unsigned char *)buffers[i].data();
+        flat.insert(flat.end(), data, data + buffers[i].size());
+    }
+
+    vch compressed;
+    if (!compressPacketBody(flat, &compressed))
+        return;
+
+    entries.clear();
+    framing.swap(compressed);
+
+    header.clear();
+    VchWriter h(&header);
+    h.put<uint8_t>(PACKET_FRAMEBATCH_CHAR | PACKET_COMPRESSED_FLAG);
+    h.put<uint64_t>(framing.size());
+
+    buffers = {boost::asio::buffer(header), boost::asio::buffer(framing)};
+}
+
+size_t PackedFrameBatch::size() const
+{
+    return boost::asio::buffer_size(buffers);
+}
+const vector<boost::asio::const_buffer> &PackedFrameBatch::asBuffers() const
+{
+    return buffers;
+}
+
+void unpackFrameBatch(VchReader *reader, vector<FrameEventsPacket> *frames)
+{
+    uint64_t frame = reader->getVarint();
+    unsigned int numFrames = 0;
+
+    while (!reader->atEnd() && reader->ok())
+    {
+        uint64_t entryHeader = reader->getVarint();
+        if (entryHeader == 1)
+        {
+            if (numFrames + 1 > MAX_FRAMES_PER_BATCH)
+            {
+                reader->fail(VchReader::ValueTooBig);
+                return;
+            }
+
+            FrameEventsPacket fcp(frame, {}, {});
+            fcp.unpackContentsAndMoveIter(reader);
+            frames->push_back(fcp);
+
+            frame++;
+            numFrames++;
+        }
+        else if ((entryHeader & 1) == 0 && entryHeader > 0)
+        {
+            uint64_t runLength = entryHeader >> 1;
+            if (runLength > MAX_FRAMES_PER_BATCH - numFrames)
+            {
+                reader->fail(VchReader::ValueTooBig);
+                return;
+            }
+
+            for (uint64_t i = 0; i < runLength; i++)
+            {
+                frames->push_back(FrameEventsPacket(frame, {}, {}));
+                frame++;
+            }
+            numFrames += runLength;
+        }
+        else
+        {
+            reader->fail(VchReader::BadEncoding);
+        }
+    }
+}
+
+vector<boost::shared_ptr<const PackedPacket>> packResyncChunks(const vch &packedResync, const vector<size_t> &entityOffsets, bool isDelta)
+{
+    // where each chunk ends: at the last entity boundary that keeps it under RESYNC_CHUNK_SIZE, if there is one
+    vector<size_t> chunkEnds;
+    size_t chunkStart = 0;
+    size_t lastBoundary = 0;
+    for (size_t i = 0; i <= entityOffsets.size(); i++)
+    {
+        size_t boundary = i < entityOffsets.size() ? entityOffsets[i] : packedResync.size();
+        if (boundary - chunkStart > RESYNC_CHUNK_SIZE && lastBoundary > chunkStart)
+        {
+            chunkEnds.push_back(lastBoundary);
+            chunkStart = lastBoundary;
+        }
+        lastBoundary = boundary;
+    }
+    chunkEnds.push_back(packedResync.size());
+
+    vector<boost::shared_ptr<const PackedPacket>> chunks;
+    chunkStart = 0;
+    for (unsigned int i = 0; i < chunkEnds.size(); i++)
+    {
+        unsigned char flags = isDelta ? RESYNCCHUNK_DELTA_FLAG : 0;
+        if (i == 0)
+            flags |= RESYNCCHUNK_FIRST_FLAG;
+        if (i == chunkEnds.size() - 1)
+            flags |= RESYNCCHUNK_LAST_FLAG;
+
+        vch body;
+        body.reserve(1 + chunkEnds[i] - chunkStart);
+        body.push_back(flags);
+        body.insert(body.end(), packedResync.begin() + chunkStart, packedResync.begin() + chunkEnds[i]);
+
+        chunks.push_back(boost::shared_ptr<const PackedPacket>(new PackedPacket(PACKET_RESYNCCHUNK_CHAR, std::move(body), true)));
+
+        chunkStart = chunkEnds[i];
+    }
+
+    return chunks;
+}
+
+ResyncAssembler::ResyncAssembler()
+    : inProgress(false), gameEntitiesLeft(0), isDelta(false) {}
+
+bool ResyncAssembler::receiveChunk(VchReader *reader)
+{
+    unsigned char flags = reader->get<uint8_t>();
+
+    if (flags & RESYNCCHUNK_FIRST_FLAG)
+    {
+        isDelta = flags & RESYNCCHUNK_DELTA_FLAG;
+        if (isDelta)
+        {
+            delta = GameDelta();
+            delta.unpackHeadAndMoveIter(reader);
+        }
+        else
+        {
+            game = Game();
+            gameEntitiesLeft = game.unpackHeadAndMoveIter(reader);
+        }
+        inProgress = true;
+    }
+    else if (!inProgress || isDelta != (bool)(flags & RESYNCCHUNK_DELTA_FLAG))
+    {
+        reader->fail(VchReader::BadEncoding);
+    }
+
+    while (reader->ok() && !reader->atEnd())
+    {
+        if (isDelta)
+        {
+            delta.unpackNextEntityAndMoveIter(reader);
+        }
+        else if (gameEntitiesLeft == 0)
+        {
+            reader->fail(VchReader::BadEncoding);
+        }
+        else
+        {
+            game.unpackNextEntityAndMoveIter(reader);
+            gameEntitiesLeft--;
+        }
+    }
+
+    if (reader->ok() && (flags & RESYNCCHUNK_LAST_FLAG))
+    {
+        size_t entitiesLeft = isDelta ? delta.numEntitiesLeftToUnpack() : gameEntitiesLeft;
+        if (entitiesLeft > 0)
+            reader->fail(VchReader::Truncated);
+        else
+        {
+            inProgress = false;
+            return true;
+        }
+    }
+
+    if (!reader->ok())
+        inProgress = false;
+
+    return false;
 }
\ No newline at end of file
@@ -1,4 +1,6 @@
+#include <array>
 #include <boost/shared_ptr.hpp>
+#include <boost/asio.hpp>
 #include "cmds.h"
 #include "vchpack.h"
 #include "stdint.h"
@@ -15,17 +17,37 @@ public:
     virtual unsigned char typechar();
 
     virtual void pack(vch *dest);
-    virtual void unpackAndMoveIter(vchIter *iter);
+    virtual void unpackAndMoveIter(VchReader *reader);
 
     void packPacket(vch *destVch);
-    void unpackPacketAndMoveIter(vchIter *iter);
+    void unpackPacketAndMoveIter(VchReader *reader);
 
     Packet();
-    Packet(vchIter *iter);
+    Packet(VchReader *reader);
 };
 
 // note that a resync packet is so simple that it's just made directly in server and client
 
+// A fully serialized packet: 1-byte typechar and 8-byte size header, then the body.
+// Built once, then shared read-only by every channel that sends it; the header is kept
+// apart from the body so both can go out in one gather-write without moving the body.
+class PackedPacket
+{
+    vch header;
+    vch body;
+public:
+    unsigned char typechar() const;
+    size_t size() const;
+    std::array<boost::asio::const_buffer, 2> asBuffers() const;
+
+    // If compress is set, a big enough body goes out compressed; worth doing off the tick thread.
+    PackedPacket(unsigned char typechar, vch body, bool compress = false);
+};
+
+// The body of a packet with PACKET_COMPRESSED_FLAG set. Both return false if it isn't worth it / isn't valid.
+bool compressPacketBody(const vch &body, vch *dest);
+bool decompressPacketBody(const unsigned char *compressed, size_t compressedSize, vch *dest);
+
 struct FrameEventsPacket : public Packet
 {
     unsigned char typechar();
@@ -34,11 +56,73 @@ struct FrameEventsPacket : public Packet
     vector<boost::shared_ptr<AuthdCmd>> authdCmds;
     vector<boost::shared_ptr<Event>> events;
 
+    bool isEmpty();
+
     void pack(vch *dest);
-    void unpackAndMoveIter(vchIter *iter);
+    void unpackAndMoveIter(VchReader *reader);
+
+    // everything but the frame number
+    void packContents(vch *dest);
+    void unpackContentsAndMoveIter(VchReader *reader);
+
+    // this frame's entry in a PackedFrameBatch; only for frames that aren't empty
+    void packBatchEntry(vch *dest);
 
     FrameEventsPacket(uint64_t frame, vector<boost::shared_ptr<AuthdCmd>> authdCmds, vector<boost::shared_ptr<Event>> events);
-    FrameEventsPacket(vchIter *iter);
+    FrameEventsPacket(VchReader *reader);
+};
+
+// A run of consecutive frames sent as one packet, so a client that's fallen behind (or is catching up
+// after a resync) gets everything it's missing in one write, and the empty frames that make up most of
+// a game cost next to nothing.
+//
+// The body is the first frame's number, then an entry per frame in order, up to the end of the packet:
+//     varint (n << 1)           n empty frames
+//     1, then packContents()    one frame with cmds or events
+// The non-empty entries are packed once per frame by the server and shared by every channel's batch;
+// only the header, the first frame and the run lengths are per channel.
+//
+// A batch past PACKET_COMPRESSION_THRESHOLD is flattened and compressed, which gives up the sharing; only
+// laggards and clients catching up after a resync get batches that big.
+class PackedFrameBatch
+{
+    vch header;
+    vch framing;
+    vector<boost::shared_ptr<const vch>> entries;
+    vector<boost::asio::const_buffer> buffers;
+
+    void compressFlattened();
+public:
+    size_t size() const;
+    const vector<boost::asio::const_buffer> &asBuffers() const;
+
+    // frameEntries[i] is frame firstFrame + i's packBatchEntry() bytes, or null if it was empty
+    PackedFrameBatch(uint64_t firstFrame, const vector<boost::shared_ptr<const vch>> &frameEntries);
+};
+
+// Expands a PACKET_FRAMEBATCH_CHAR body back into one FrameEventsPacket per frame.
+void unpackFrameBatch(VchReader *reader, vector<FrameEventsPacket> *frames);
+
+// Splits a packed resync (Game::pack or Game::packDelta, with its entityOffsets) into PACKET_RESYNCCHUNK_CHAR
+// packets. Chunks only break between entities, so each can be decoded as soon as it arrives; the first one
+// carries the head, and one entity bigger than RESYNC_CHUNK_SIZE gets a chunk to itself.
+vector<boost::shared_ptr<const PackedPacket>> packResyncChunks(const vch &packedResync, const vector<size_t> &entityOffsets, bool isDelta);
+
+// Puts a chunked resync back together on the client, decoding each chunk as it comes in, so the client never
+// has to hold more than a chunk of packed resync and can interleave chunks with frame packets.
+class ResyncAssembler
+{
+    bool inProgress;
+    EntityRef gameEntitiesLeft;
+public:
+    bool isDelta;
+    Game game; // the result, if !isDelta
+    GameDelta delta; // the result, if isDelta
+
+    // True once the last chunk is in. Anything malformed is flagged on the reader, and the resync is dropped.
+    bool receiveChunk(VchReader *reader);
+
+    ResyncAssembler();
 };
 
 #endif // PACKETS_H
\ No newline at end of file
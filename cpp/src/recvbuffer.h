@@ -0,0 +1,69 @@
+#ifndef RECVBUFFER_H
+#define RECVBUFFER_H
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <boost/asio.hpp>
+
+// Bytes read off a socket that haven't been parsed yet. Reads go into the free space at the back (prepare,
+// then commit once the read's done) and parsing takes complete messages off the front (data, consume), so a
+// single read can deliver any number of messages and nothing's allocated per message.
+//
+// Rather than wrapping around like a true ring, whatever's left unparsed is moved back to the start when the
+// back runs out of room; it's rarely more than a partial message, and this way a message is always contiguous
+// and can be decoded in place.
+class ReceiveBuffer
+{
+    std::vector<unsigned char> buf;
+    size_t start; // first unparsed byte
+    size_t end;   // one past the last byte read
+    size_t readSize;
+
+public:
+    // readSize is how much room each read asks for, at least
+    ReceiveBuffer(size_t readSize) : buf(readSize), start(0), end(0), readSize(readSize) {}
+
+    const unsigned char *data() const { return buf.data() + start; }
+    size_t size() const { return end - start; }
+
+    void consume(size_t numBytes)
+    {
+        start += numBytes;
+        if (start == end)
+            start = end = 0;
+    }
+
+    void clear()
+    {
+        start = end = 0;
+    }
+
+    // Free space for the next read: at least readSize, or more if the message in progress needs it to land
+    // in one piece (minFree counts from what's already buffered).
+    boost::asio::mutable_buffer prepare(size_t minFree = 0)
+    {
+        size_t wanted = std::max(minFree, readSize);
+
+        if (buf.size() - end < wanted)
+        {
+            if (start > 0)
+            {
+                memmove(buf.data(), buf.data() + start, end - start);
+                end -= start;
+                start = 0;
+            }
+            if (buf.size() - end < wanted)
+                buf.resize(end + wanted);
+        }
+
+        return boost::asio::buffer(buf.data() + end, buf.size() - end);
+    }
+
+    void commit(size_t numBytes)
+    {
+        end += numBytes;
+    }
+};
+
+#endif // RECVBUFFER_H
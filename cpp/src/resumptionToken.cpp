@@ -0,0 +1,129 @@
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include "resumptionToken.h"
+#include "config.h"
+
+const size_t KEY_SIZE = 32;
+const size_t SIGNED_AT_SIZE = sizeof(uint64_t);
+const size_t MAC_SIZE = 32; // SHA-256
+
+const unsigned char *getKey()
+{
+    static unsigned char key[KEY_SIZE];
+    static once_flag keyGenerated;
+    call_once(keyGenerated, []
+    {
+        if (RAND_bytes(key, KEY_SIZE) != 1)
+            throw runtime_error("Couldn't generate a resumption token key");
+    });
+    return key;
+}
+
+uint64_t secondsSinceEpoch()
+{
+    return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// over the signing time (big-endian) and then the address
+void computeMac(const unsigned char *signedAtBytes, const string &address, unsigned char *mac)
+{
+    string signedPart(reinterpret_cast<const char *>(signedAtBytes), SIGNED_AT_SIZE);
+    signedPart += address;
+
+    unsigned int macSize;
+    HMAC(EVP_sha256(), getKey(), KEY_SIZE, reinterpret_cast<const unsigned char *>(signedPart.data()), signedPart.size(), mac, &macSize);
+}
+
+string toHex(const unsigned char *bytes, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (size_t i = 0; i < size; i++)
+    {
+        hex += digits[bytes[i] >> 4];
+        hex += digits[bytes[i] & 0xf];
+    }
+    return hex;
+}
+
+optional<string> fromHex(const string &hex)
+{
+    if (hex.size() % 2 != 0)
+        return {};
+
+    string bytes;
+    for (size_t i = 0; i < hex.size(); i += 2)
+    {
+        int byte = 0;
+        for (size_t j = i; j < i + 2; j++)
+        {
+            char c = hex[j];
+            int nibble;
+            if (c >= '0' && c <= '9')
+                nibble = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                nibble = c - 'a' + 10;
+            else
+                return {};
+            byte = (byte << 4) | nibble;
+        }
+        bytes += (char)byte;
+    }
+    return bytes;
+}
+
+// [signedAt][mac][address], hex
+string issueResumptionToken(string address, uint64_t signedAt)
+{
+    unsigned char signedAtBytes[SIGNED_AT_SIZE];
+    for (size_t i = 0; i < SIGNED_AT_SIZE; i++)
+    {
+        signedAtBytes[i] = signedAt >> (8 * (SIGNED_AT_SIZE - 1 - i));
+    }
+
+    unsigned char mac[MAC_SIZE];
+    computeMac(signedAtBytes, address, mac);
+
+    return toHex(signedAtBytes, SIGNED_AT_SIZE) + toHex(mac, MAC_SIZE) + toHex(reinterpret_cast<const unsigned char *>(address.data()), address.size());
+}
+
+optional<string> resumptionTokenToAddress(string token, uint64_t *signedAt, string *error)
+{
+    optional<string> maybeBytes = fromHex(token);
+    if (!maybeBytes || maybeBytes->size() < SIGNED_AT_SIZE + MAC_SIZE)
+    {
+        *error = "malformed token";
+        return {};
+    }
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(maybeBytes->data());
+    const unsigned char *signedAtBytes = bytes;
+    const unsigned char *mac = bytes + SIGNED_AT_SIZE;
+    string address = maybeBytes->substr(SIGNED_AT_SIZE + MAC_SIZE);
+
+    unsigned char expectedMac[MAC_SIZE];
+    computeMac(signedAtBytes, address, expectedMac);
+    if (CRYPTO_memcmp(mac, expectedMac, MAC_SIZE) != 0)
+    {
+        *error = "bad MAC (forged, or from before a server restart)";
+        return {};
+    }
+
+    uint64_t tokenSignedAt = 0;
+    for (size_t i = 0; i < SIGNED_AT_SIZE; i++)
+    {
+        tokenSignedAt = (tokenSignedAt << 8) | signedAtBytes[i];
+    }
+    if (secondsSinceEpoch() >= tokenSignedAt + RESUMPTION_TOKEN_LIFETIME.count())
+    {
+        *error = "expired";
+        return {};
+    }
+
+    *signedAt = tokenSignedAt;
+    return address;
+}
@@ -0,0 +1,22 @@
+#ifndef RESUMPTIONTOKEN_H
+#define RESUMPTIONTOKEN_H
+
+#include <cstdint>
+#include <string>
+#include <optional>
+
+using namespace std;
+
+// Once a client's proven who it is, the server hands it one of these; presented on a reconnect, it stands in for
+// a fresh sig, without recovering anything. It's the address, when that address last signed a challenge, and an
+// HMAC over both with a key that lives and dies with the server process, all hex-encoded. It's good until
+// RESUMPTION_TOKEN_LIFETIME after the signing. A token issued to a resumed handshake keeps the original signing
+// time, so trading one token for the next never extends that, and a client has to sign again at least that often.
+// Anyone who gets hold of one can use it until then, same as a session cookie.
+string issueResumptionToken(string address, uint64_t signedAt);
+// Also gives the signing time, to issue the next token with.
+optional<string> resumptionTokenToAddress(string token, uint64_t *signedAt, string *error);
+
+uint64_t secondsSinceEpoch();
+
+#endif // RESUMPTIONTOKEN_H
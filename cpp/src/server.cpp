@@ -2,24 +2,46 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/use_awaitable.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
 #include <filesystem>
 #include <vector>
+#include <deque>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#ifdef __linux__
+#include <netinet/tcp.h>
+#endif
 #include "cmds.h"
 #include "engine.h"
 #include "config.h"
 #include "packets.h"
 #include "sigWrapper.h"
+#include "resumptionToken.h"
 #include "events.h"
+#include "recvbuffer.h"
+#include "mpscqueue.h"
+#include "uring.h"
+#include "handleralloc.h"
+#include "firstsync.h"
 
 using namespace std;
 using namespace boost::asio::ip;
+using boost::asio::awaitable;
+using boost::asio::use_awaitable;
 
 class ClientChannel;
 
 vector<ClientChannel *> clientChannels;
+vector<ClientChannel *> idleChannels; // closed and done with, waiting to be reused
 
 class Listener
 {
@@ -41,7 +63,7 @@ public:
 };
 
 Game game;
-bool adminRoleTaken(false);
+atomic<bool> adminRoleTaken(false);
 
 void testHandler(const boost::system::error_code &error, size_t numSent)
 {
@@ -55,44 +77,295 @@ void testHandler(const boost::system::error_code &error, size_t numSent)
     }
 }
 
-void clearVchAndPackResyncPacket(vch *dest)
+vector<boost::shared_ptr<const PackedPacket>> packResync(Game *gameToPack, uint64_t baselineFrame)
 {
-    dest->clear();
-    game.pack(dest);
+    vch packed;
+    vector<size_t> entityOffsets;
 
-    vch prepended;
-    packToVch(&prepended, "C", PACKET_RESYNC_CHAR);
-    packToVch(&prepended, "Q", (uint64_t)(dest->size()));
+    bool isDelta = gameToPack->deltaIsWorthwhile(baselineFrame);
+    if (isDelta)
+        gameToPack->packDelta(&packed, baselineFrame, &entityOffsets);
+    else
+        gameToPack->pack(&packed, &entityOffsets);
 
-    dest->insert(dest->begin(), prepended.begin(), prepended.end());
+    return packResyncChunks(packed, entityOffsets, isDelta);
 }
-void clearVchAndPackFrameCmdsPacket(vch *dest, FrameEventsPacket fcp)
+// null for an empty frame, which a batch sends as part of a run length instead
+boost::shared_ptr<const vch> packFrameBatchEntry(FrameEventsPacket *fcp)
 {
-    dest->clear();
-
-    fcp.pack(dest);
+    if (fcp->isEmpty())
+        return boost::shared_ptr<const vch>();
 
-    vch prepended;
-    packToVch(&prepended, "C", PACKET_FRAMECMDS_CHAR);
-    packToVch(&prepended, "Q", (uint64_t)dest->size());
+    boost::shared_ptr<vch> entry(new vch);
+    fcp->packBatchEntry(entry.get());
 
-    dest->insert(dest->begin(), prepended.begin(), prepended.end());
+    return entry;
 }
 
-vector<boost::shared_ptr<AuthdCmd>> pendingCmds;
+// A resync for one frame. It's packed on the ResyncPacker's thread from a deep copy of the game,
+// and every client that joins on that frame from the same baseline shares the job and its packet.
+// A baselineFrame of 0 means the client has no game yet and needs all of it.
+struct ResyncJob
+{
+    uint64_t frame;
+    uint64_t baselineFrame;
+    boost::shared_ptr<Game> snapshot; // dropped by the packer once it's done with it
+    vector<boost::shared_ptr<const PackedPacket>> chunks; // only valid once done is true
+    atomic<bool> done;
+
+    ResyncJob(boost::shared_ptr<Game> snapshot, uint64_t baselineFrame)
+        : frame(snapshot->frame), baselineFrame(baselineFrame), snapshot(snapshot), done(false) {}
+};
+
+class ResyncPacker
+{
+    mutex jobsMutex;
+    condition_variable jobsChanged;
+    deque<boost::shared_ptr<ResyncJob>> queuedJobs;
+    bool stopping;
+
+    vector<boost::shared_ptr<ResyncJob>> currentFrameJobs; // tick thread only
+    boost::shared_ptr<Game> currentFrameSnapshot; // tick thread only; shared by currentFrameJobs
+    thread worker;
+
+    void workerLoop()
+    {
+        while (true)
+        {
+            boost::shared_ptr<ResyncJob> job;
+            {
+                unique_lock<mutex> lock(jobsMutex);
+                jobsChanged.wait(lock, [this] { return stopping || queuedJobs.size() > 0; });
+                if (stopping)
+                    return;
+
+                job = queuedJobs.front();
+                queuedJobs.pop_front();
+            }
+
+            job->chunks = packResync(job->snapshot.get(), job->baselineFrame);
+
+            job->snapshot.reset();
+            job->done = true;
+        }
+    }
+
+public:
+    // Tick thread only. Reuses this frame's job for the same baseline if there is one,
+    // so a burst of joiners costs one copy and one pack.
+    boost::shared_ptr<ResyncJob> getJobForCurrentFrame(Game *game, uint64_t baselineFrame)
+    {
+        if (currentFrameJobs.size() > 0 && currentFrameJobs[0]->frame != game->frame)
+        {
+            currentFrameJobs.clear();
+            currentFrameSnapshot.reset();
+        }
+
+        for (unsigned int i = 0; i < currentFrameJobs.size(); i++)
+        {
+            if (currentFrameJobs[i]->baselineFrame == baselineFrame)
+                return currentFrameJobs[i];
+        }
+
+        // all jobs this frame can share one copy of the game
+        if (!currentFrameSnapshot)
+            currentFrameSnapshot = game->deepCopy();
+
+        boost::shared_ptr<ResyncJob> job(new ResyncJob(currentFrameSnapshot, baselineFrame));
+        currentFrameJobs.push_back(job);
+        {
+            lock_guard<mutex> lock(jobsMutex);
+            queuedJobs.push_back(job);
+        }
+        jobsChanged.notify_one();
+
+        return job;
+    }
+
+    ResyncPacker()
+        : stopping(false), worker(&ResyncPacker::workerLoop, this) {}
+    ~ResyncPacker()
+    {
+        {
+            lock_guard<mutex> lock(jobsMutex);
+            stopping = true;
+        }
+        jobsChanged.notify_one();
+        worker.join();
+    }
+};
+
+ResyncPacker resyncPacker;
+
+// The last FRAME_HISTORY_SIZE frames, as sent (see packFrameBatchEntry), so a client that drops for a moment
+// can be caught back up on what it missed instead of resynced. Tick thread only.
+class FrameHistory
+{
+    vector<boost::shared_ptr<const vch>> entries; // by frame % FRAME_HISTORY_SIZE
+    uint64_t firstFrame;
+    uint64_t endFrame; // one past the last
+
+public:
+    FrameHistory() : entries(FRAME_HISTORY_SIZE), firstFrame(0), endFrame(0) {}
+
+    // frames have to come in order
+    void add(uint64_t frame, boost::shared_ptr<const vch> entry)
+    {
+        if (frame != endFrame)
+            firstFrame = frame; // first one, or a gap; either way nothing before it lines up
+
+        entries[frame % FRAME_HISTORY_SIZE] = entry;
+        endFrame = frame + 1;
+        if (endFrame - firstFrame > FRAME_HISTORY_SIZE)
+            firstFrame = endFrame - FRAME_HISTORY_SIZE;
+    }
 
+    // Everything from frame up to the last one added, if we still have all of it and it fits under the
+    // queue caps. A laggard never passes, since its dropped frames already went over one of them.
+    bool getSince(uint64_t frame, vector<boost::shared_ptr<const vch>> *dest)
+    {
+        if (frame < firstFrame || frame > endFrame || endFrame - frame > MAX_QUEUED_FRAMES)
+            return false;
+
+        size_t bytes = 0;
+        for (uint64_t f = frame; f < endFrame; f++)
+        {
+            bytes += entries[f % FRAME_HISTORY_SIZE] ? entries[f % FRAME_HISTORY_SIZE]->size() : 1;
+        }
+        if (bytes > MAX_QUEUED_BYTES)
+            return false;
+
+        dest->clear();
+        for (uint64_t f = frame; f < endFrame; f++)
+        {
+            dest->push_back(entries[f % FRAME_HISTORY_SIZE]);
+        }
+        return true;
+    }
+};
+
+// A cmd as it came in, decoded on a network thread. The sender's resolved to a player index when the
+// tick drains the queue, since the game's only safe to read on the tick thread.
+struct ReceivedCmd
+{
+    boost::shared_ptr<Cmd> cmd;
+    string userAddress;
+};
+
+MpscQueue<ReceivedCmd> receivedCmds;
+MpscQueue<boost::shared_ptr<tcp::socket>> acceptedSockets; // the tick thread makes channels for these
+atomic<unsigned int> handshakesInProgress(0); // from accept until the handshake's over; see MAX_PENDING_HANDSHAKES
+
+// Set up in main; sig recovery is done on here.
+boost::asio::thread_pool *authPool = NULL;
+
+#ifdef HAVE_IO_URING
+// Set in main if the server's run with --io-uring. Channels still do the handshake through asio, then
+// receive and send through this instead.
+IoUring *uring = NULL;
+#endif
+
+// Everything that goes out in one gather-write. Holds onto the packets until the write's done with them.
+struct OutgoingWrite
+{
+    vector<boost::shared_ptr<const PackedPacket>> packets;
+    vector<boost::shared_ptr<const PackedFrameBatch>> batches;
+    vector<boost::asio::const_buffer> buffers;
+};
+
+// Per channel; logged when it closes.
+struct ChannelStats
+{
+    uint64_t bytesSent;
+    uint64_t writes;
+    size_t peakQueuedFrames;
+    size_t peakQueuedBytes;
+    uint64_t framesDropped;
+    unsigned int laggardResyncs;
+    uint64_t framesCaughtUp;
+
+    ChannelStats()
+        : bytesSent(0), writes(0), peakQueuedFrames(0), peakQueuedBytes(0), framesDropped(0), laggardResyncs(0), framesCaughtUp(0) {}
+};
+
+// Run on authPool, so however many clients connect at once, the network threads keep sending frames.
+awaitable<optional<string>> recoverAddressOnAuthPool(string challenge, string sig, string *error)
+{
+    co_return signedMsgToAddress(challenge, sig, error);
+}
+
+// Everything a channel does runs on its strand, on whichever network thread picks it up: the connection itself
+// is a coroutine on it (serve), write handlers are bound to it, and the tick thread posts to it (queueFrame,
+// startResync, ...) rather than calling in. Besides those, the tick thread only reads state,
+// clientBaselineFrame and the RTT.
 class ClientChannel
 {
+    typedef boost::asio::strand<boost::asio::io_context::executor_type> Strand;
+
     boost::asio::io_service &ioService;
+    Strand strand;
     boost::shared_ptr<tcp::socket> socket;
 
-    vector<vch *> packetsToSend;
+    // Whatever piles up while a write is in flight goes out together in the next one: the next resync
+    // chunk, if there is one, then every frame since the last write, coalesced into batches.
+    // Frames don't wait on the resync; the client buffers them until the last chunk is in.
+    // Capped at MAX_QUEUED_FRAMES / MAX_QUEUED_BYTES; see handleLaggard.
+    uint64_t firstFrameToSend;
+    vector<boost::shared_ptr<const vch>> frameEntriesToSend; // null entries are empty frames
+    size_t queuedBytes;
+    vector<boost::shared_ptr<const PackedPacket>> packetsToSend; // anything else; goes ahead of frames
     bool sending;
+    bool droppingFramesForResync; // between handleLaggard and the resync's start
 
-    vch receivedBytes;
-    boost::asio::streambuf receivedSig;
+    // Handlers still to run, posted ones included, and serve until it's returned. The channel can't be reused
+    // or deleted until they have, since they point at it.
+    atomic<unsigned int> pendingOps;
+    ChannelStats stats;
 
-    string sentChallenge;
+    // Declared first thing in every handler (and serve); counts it as done once it's returned.
+    struct PendingOp
+    {
+        ClientChannel *channel;
+        PendingOp(ClientChannel *channel) : channel(channel) {}
+        ~PendingOp() { channel->pendingOps--; }
+    };
+
+    // Held by serve through the handshake. Once it's let go, however the handshake went, the connection
+    // stops counting against MAX_PENDING_HANDSHAKES and the deadline's off.
+    struct HandshakeInProgress
+    {
+        ClientChannel *channel;
+        bool done;
+        HandshakeInProgress(ClientChannel *channel) : channel(channel), done(false) {}
+        ~HandshakeInProgress() { finish(); }
+        void finish()
+        {
+            if (done)
+                return;
+            done = true;
+            channel->handshakeStep++;
+            channel->handshakeTimer.cancel();
+            handshakesInProgress--;
+        }
+    };
+    boost::asio::steady_timer handshakeTimer;
+    // Bumped for each handshake step (and at the end). A deadline's handler only acts if this hasn't moved on
+    // since it was set: cancelling only stops waits that haven't fired yet, not a handler that's already queued.
+    // Strand.
+    unsigned int handshakeStep;
+
+    boost::shared_ptr<ResyncJob> pendingResync;
+    unsigned int resyncChunksSent;
+
+    ReceiveBuffer receiveBuffer;
+
+    // For the ops that come around most: a frame every tick, and every write. Sized for what asio asks for
+    // (a post's op is about 100 bytes, a socket write's about 600); it's only a matter of speed if they're off.
+    HandlerMemory frameHandlerMemory;
+    HandlerMemory writeHandlerMemory;
+#ifdef HAVE_IO_URING
+    HandlerMemory receiveHandlerMemory;
+#endif
 
     string genRandomString(int len)
     {
@@ -116,210 +389,643 @@ public:
     enum State {
         DoingHandshake,
         ReadyForFirstSync,
+        WaitingForResync,
         UpToDate,
         Closed
-    } state;
+    };
+    atomic<State> state;
     string connectionAuthdUserAddress;
+    uint64_t clientBaselineFrame;
+    // The connection's smoothed round trip time and its mean deviation in microseconds, as the kernel had them at
+    // the last sampleRtt; 0 if it hasn't been sampled.
+    atomic<uint32_t> rttMicros;
+    atomic<uint32_t> rttVarMicros;
     ClientChannel(boost::asio::io_service &ioService_, boost::shared_ptr<tcp::socket> socket_)
-        : ioService(ioService_), socket(socket_), receivedSig(150)
+        : ioService(ioService_), strand(boost::asio::make_strand(ioService_)), handshakeTimer(strand), handshakeStep(0), receiveBuffer(SOCKET_READ_SIZE),
+          frameHandlerMemory(128), writeHandlerMemory(640)
+#ifdef HAVE_IO_URING
+          , receiveHandlerMemory(128)
+#endif
+    {
+        reset(socket_);
+    }
+
+    // Readies a new or recycled channel for a fresh connection. Buffers keep their capacity.
+    // Tick thread, and only while nothing's pending.
+    void reset(boost::shared_ptr<tcp::socket> socket_)
     {
+        socket = socket_;
         state = DoingHandshake;
+        connectionAuthdUserAddress = "";
         sending = false;
+        droppingFramesForResync = false;
+        firstFrameToSend = 0;
+        frameEntriesToSend.clear();
+        queuedBytes = 0;
+        packetsToSend.clear();
+        pendingOps = 0;
+        stats = ChannelStats();
+        pendingResync.reset();
+        resyncChunksSent = 0;
+        clientBaselineFrame = 0;
+        rttMicros = rttVarMicros = 0;
+        receiveBuffer.clear();
     }
 
-    void startHandshakeAsync()
+    // Closing the socket aborts anything in flight; those handlers still run, with an error.
+    // io_uring ops are ended by the shutdown instead. They look the socket up by its fd, maybe not until a held
+    // submit goes (see IoUring::holdSubmits), so the fd can't be closed and reused while any are pending; it's
+    // closed with releaseSocket.
+    void close()
     {
-        generateAndSendSigChallenge();
-        receiveSigAsync(); // also kicks off receiving loop
+        if (state == Closed)
+            return;
+        state = Closed;
+
+        boost::system::error_code ignored;
+        socket->shutdown(tcp::socket::shutdown_both, ignored);
+#ifdef HAVE_IO_URING
+        if (!uring)
+#endif
+            socket->close(ignored);
+
+        frameEntriesToSend.clear();
+        queuedBytes = 0;
+        packetsToSend.clear();
+        pendingResync.reset();
+
+        cout << "Closed channel for " << connectionAuthdUserAddress << ": sent " << stats.bytesSent << " bytes in " << stats.writes << " writes, "
+             << "peak queue " << stats.peakQueuedFrames << " frames / " << stats.peakQueuedBytes << " bytes, "
+             << stats.framesDropped << " frames dropped over " << stats.laggardResyncs << " laggard resyncs, "
+             << stats.framesCaughtUp << " frames caught up from history" << endl;
     }
 
-    void generateAndSendSigChallenge()
+    // tick thread
+    bool readyToRecycle()
     {
-        string challenge = genRandomString(50);
-
-        boost::asio::write(*socket, boost::asio::buffer(challenge));
-
-        cout << "sent challenge" << endl;
-
-        sentChallenge = challenge;
+        return state == Closed && pendingOps == 0;
+    }
+    // tick thread, once readyToRecycle
+    void releaseSocket()
+    {
+        socket.reset();
     }
 
-    void receiveSigAsync()
+    // tick thread
+    void startServing()
     {
-        boost::asio::async_read_until(*socket,
-                   receivedSig,
-                   '\n',
-                   boost::bind(&ClientChannel::sigReceived,
-                               this,
-                               boost::asio::placeholders::error,
-                               boost::asio::placeholders::bytes_transferred));
+        pendingOps++;
+        boost::asio::co_spawn(strand, serve(), boost::asio::detached);
     }
 
-    void sigReceived(const boost::system::error_code &error, size_t transferred)
+    // Closes the channel (aborting whatever it's waiting on) if the handshake's still at this step after
+    // timeout. Strand.
+    void setHandshakeDeadline(const char *step, chrono::steady_clock::duration timeout)
     {
-        cout << "sig received" << endl;
-        if (error)
+        pendingOps++;
+        unsigned int thisStep = ++handshakeStep;
+        handshakeTimer.expires_after(timeout); // the last step's wait gets operation_aborted, if it's still waiting
+        handshakeTimer.async_wait([this, step, thisStep](const boost::system::error_code &error)
         {
-            cout << "Error receiving sig from " << connectionAuthdUserAddress << ". Kicking." << endl;
-            state = Closed;
-        }
-        else
+            PendingOp op(this);
+
+            if (error || state != DoingHandshake || handshakeStep != thisStep)
+                return;
+            boost::system::error_code ignored;
+            cout << "Timed out " << step << " " << socket->remote_endpoint(ignored) << ". Kicking." << endl;
+            close();
+        });
+    }
+
+    // The whole connection, from the handshake on: receiving cmds is the rest of it. Sending's driven by the
+    // tick instead (sendNextPacketIfNotBusy). Returns once the channel's closed, one way or another.
+    awaitable<void> serve()
+    {
+        PendingOp op(this);
+        HandshakeInProgress handshake(this);
+
+        const char *doing = "sending challenge to";
+        try
         {
-            // receivedSig now has sig
-            // But leave out the trailing \n leftover
+            setHandshakeDeadline(doing, HANDSHAKE_STEP_TIMEOUT);
+            string challenge = genRandomString(50);
+            co_await boost::asio::async_write(*socket, boost::asio::buffer(challenge), use_awaitable);
+            cout << "sent challenge" << endl;
+
+            // a sig, or "resume " and a resumption token
+            doing = "receiving sig from";
+            setHandshakeDeadline(doing, HANDSHAKE_SIG_TIMEOUT);
+            boost::asio::streambuf receivedSig(256);
+            co_await boost::asio::async_read_until(*socket, receivedSig, '\n', use_awaitable);
+            cout << "sig received" << endl;
+
+            // leave out the trailing \n
             string sig(boost::asio::buffer_cast<const char*>(receivedSig.data()), receivedSig.size() - 1);
 
-            if (sig == string("admin"))
+            // when the client last signed a challenge; a resumed session's next token keeps the original time
+            uint64_t signedAt = secondsSinceEpoch();
+            if (boost::starts_with(sig, "resume "))
             {
-                if (!adminRoleTaken)
+                // no ECDSA recovery; this is what keeps a reconnect storm cheap
+                string error;
+                if (auto maybeResumedAddress = resumptionTokenToAddress(sig.substr(7), &signedAt, &error))
+                {
+                    connectionAuthdUserAddress = *maybeResumedAddress;
+                }
+                else
+                {
+                    cout << "Refused resumption token: " << error << ". Kicking." << endl;
+                    close();
+                    co_return;
+                }
+            }
+            else if (sig == string("admin"))
+            {
+                if (!adminRoleTaken.exchange(true))
                 {
-                    adminRoleTaken = true;
                     connectionAuthdUserAddress = string("0xBB5eb03535FA2bCFe9FE3BBb0F9cC48385818d92");
                 }
             }
             else
             {
-                // now have sig and sentChallenge as strings.
+                doing = "recovering the address of";
+                setHandshakeDeadline(doing, HANDSHAKE_STEP_TIMEOUT);
                 string error;
-                if (auto maybeRecoveredAddress = signedMsgToAddress(sentChallenge, sig, &error))
+                optional<string> maybeRecoveredAddress = co_await boost::asio::co_spawn(authPool->get_executor(), recoverAddressOnAuthPool(challenge, sig, &error), use_awaitable);
+                if (state == Closed)
+                    co_return;
+                if (maybeRecoveredAddress)
                 {
                     connectionAuthdUserAddress = *maybeRecoveredAddress;
                 }
                 else
                 {
-                    cout << "Error recovering address from connection. Kicking." << endl << "Here's the Python error message:" << endl;
-                    cout << error << endl;
-                    state = Closed;
-                    return;
+                    cout << "Error recovering address from connection: " << error << ". Kicking." << endl;
+                    close();
+                    co_return;
                 }
             }
 
             cout << "Player authenticated and connected." << endl;
 
             // should really return a fail/success code here. On fail client just hangs atm.
-            boost::asio::write(*socket, boost::asio::buffer(connectionAuthdUserAddress));
-
+            doing = "sending address to";
+            setHandshakeDeadline(doing, HANDSHAKE_STEP_TIMEOUT);
+            co_await boost::asio::async_write(*socket, boost::asio::buffer(connectionAuthdUserAddress), use_awaitable);
+
+            // good until RESUMPTION_TOKEN_LIFETIME after the last actual signing, however often it's resumed
+            doing = "sending resumption token to";
+            string resumptionToken = issueResumptionToken(connectionAuthdUserAddress, signedAt) + "\n";
+            co_await boost::asio::async_write(*socket, boost::asio::buffer(resumptionToken), use_awaitable);
+
+            // The client tells us which frame its game is at (0 if it has none) so its resync can be a delta.
+            doing = "receiving baseline frame from";
+            setHandshakeDeadline(doing, HANDSHAKE_STEP_TIMEOUT);
+            unsigned char baselineFrameBytes[sizeof(uint64_t)];
+            co_await boost::asio::async_read(*socket, boost::asio::buffer(baselineFrameBytes), use_awaitable);
+            clientBaselineFrame = VchReader(baselineFrameBytes, sizeof(baselineFrameBytes)).get<uint64_t>();
+
+            handshake.finish();
             state = ReadyForFirstSync;
-            startReceivingLoop();
+
+#ifdef HAVE_IO_URING
+            if (uring)
+            {
+                // the kernel drives the receiving from here; see uringReceiveAsync
+                uringReceiveAsync();
+                co_return;
+            }
+#endif
+
+            doing = "receiving cmds from";
+            size_t bytesStillNeeded = 0;
+            while (true)
+            {
+                size_t received = co_await socket->async_read_some(receiveBuffer.prepare(bytesStillNeeded), use_awaitable);
+                if (state == Closed)
+                    co_return;
+                receiveBuffer.commit(received);
+
+                bytesStillNeeded = handleReceivedCmds();
+            }
+        }
+        catch (boost::system::system_error &e)
+        {
+            // closing the socket aborts whatever we were waiting on
+            if (state == Closed)
+                co_return;
+
+            cout << "Error " << doing << " " << connectionAuthdUserAddress << ": " << e.code().message() << endl << "Kicking." << endl;
+            close();
         }
     }
 
-    void sendResyncPacket()
+    // Tick thread.
+    void kick(string reason)
+    {
+        pendingOps++;
+        boost::asio::post(strand, boost::bind(&ClientChannel::kicked, this, reason));
+    }
+    void kicked(string reason)
     {
-        packetsToSend.push_back(new vch);
+        PendingOp op(this);
+        if (state == Closed)
+            return;
 
-        clearVchAndPackResyncPacket(packetsToSend.back());
+        cout << "Client " << connectionAuthdUserAddress << " " << reason << ". Kicking." << endl;
+        close();
+    }
+
+    // Tick thread, for a channel that's ReadyForFirstSync. The state changes right away so the next tick
+    // doesn't start another.
+    void startResync(boost::shared_ptr<ResyncJob> resyncJob)
+    {
+        State expected = ReadyForFirstSync;
+        if (!state.compare_exchange_strong(expected, WaitingForResync))
+            return;
+
+        pendingOps++;
+        boost::asio::post(strand, boost::bind(&ClientChannel::resyncStarted, this, resyncJob));
+    }
+    void resyncStarted(boost::shared_ptr<ResyncJob> resyncJob)
+    {
+        PendingOp op(this);
+        if (state == Closed)
+            return;
+
+        pendingResync = resyncJob;
+        resyncChunksSent = 0;
+        droppingFramesForResync = false;
+    }
+
+    // Tick thread, for a channel that's ReadyForFirstSync and already has a game: rather than a resync, it gets
+    // the frames it missed, starting at its baseline frame, followed by the frames it would've gotten anyway.
+    void startCatchUp(vector<boost::shared_ptr<const vch>> missedEntries)
+    {
+        State expected = ReadyForFirstSync;
+        if (!state.compare_exchange_strong(expected, UpToDate))
+            return;
+
+        vch body;
+        VchWriter(&body).putVarint(clientBaselineFrame);
+        boost::shared_ptr<const PackedPacket> catchUpPacket(new PackedPacket(PACKET_CATCHUP_CHAR, body));
+
+        pendingOps++;
+        boost::asio::post(strand, boost::bind(&ClientChannel::catchUpStarted, this, catchUpPacket, missedEntries));
+    }
+    void catchUpStarted(boost::shared_ptr<const PackedPacket> catchUpPacket, vector<boost::shared_ptr<const vch>> missedEntries)
+    {
+        PendingOp op(this);
+        if (state == Closed)
+            return;
+
+        cout << "Catching " << connectionAuthdUserAddress << " up on " << missedEntries.size() << " frames from history" << endl;
+        stats.framesCaughtUp += missedEntries.size();
+
+        packetsToSend.push_back(catchUpPacket);
+
+        // The queue's empty: a laggard's was dropped, and anything else hasn't been queued anything yet. Frames
+        // queued from here on follow on from missedEntries, so they're not to be dropped, laggard or not.
+        droppingFramesForResync = false;
+        firstFrameToSend = clientBaselineFrame;
+        frameEntriesToSend = missedEntries;
+        for (unsigned int i = 0; i < missedEntries.size(); i++)
+        {
+            queuedBytes += missedEntries[i] ? missedEntries[i]->size() : 1;
+        }
 
         sendNextPacketIfNotBusy();
     }
 
-    void sendFrameCmdsPacket(FrameEventsPacket fcp)
+    // Tick thread. entry is shared with every other channel, so it must not be modified.
+    // sendHold (from IoUring::holdSubmits, or null) is let go once the frame's been handed on for sending, so
+    // with io_uring a whole tick's sends go in one submit. Same for queuePacket and sendResyncIfReady.
+    void queueFrame(uint64_t frame, boost::shared_ptr<const vch> entry, boost::shared_ptr<void> sendHold)
     {
-        packetsToSend.push_back(new vch);
+        pendingOps++;
+        boost::asio::post(strand, makeCustomAllocHandler(frameHandlerMemory, boost::bind(&ClientChannel::sendFrame, this, frame, entry, sendHold)));
+    }
+    void sendFrame(uint64_t frame, boost::shared_ptr<const vch> entry, boost::shared_ptr<void> sendHold)
+    {
+        PendingOp op(this);
+        if (state == Closed)
+            return;
+
+        // frames the tick queued before it saw we'd fallen behind; the resync covers them
+        if (droppingFramesForResync)
+        {
+            stats.framesDropped++;
+            return;
+        }
+
+        if (frameEntriesToSend.size() == 0)
+            firstFrameToSend = frame;
+        assert(frame == firstFrameToSend + frameEntriesToSend.size());
 
-        clearVchAndPackFrameCmdsPacket(packetsToSend.back(), fcp);
+        frameEntriesToSend.push_back(entry);
+        queuedBytes += entry ? entry->size() : 1;
+
+        stats.peakQueuedFrames = max(stats.peakQueuedFrames, frameEntriesToSend.size());
+        stats.peakQueuedBytes = max(stats.peakQueuedBytes, queuedBytes);
+
+        if (frameEntriesToSend.size() > MAX_QUEUED_FRAMES || queuedBytes > MAX_QUEUED_BYTES)
+        {
+            handleLaggard();
+            return;
+        }
 
         sendNextPacketIfNotBusy();
     }
 
-    void startReceivingLoop()
+    // Tick thread. For the odd packet that isn't a frame or a resync; not capped, so keep it to small, rare ones.
+    void queuePacket(boost::shared_ptr<const PackedPacket> packet, boost::shared_ptr<void> sendHold)
     {
-        clearVchAndReceiveNextCmd();
+        pendingOps++;
+        boost::asio::post(strand, boost::bind(&ClientChannel::sendPacket, this, packet, sendHold));
     }
+    void sendPacket(boost::shared_ptr<const PackedPacket> packet, boost::shared_ptr<void> sendHold)
+    {
+        PendingOp op(this);
+        if (state == Closed)
+            return;
 
-    void sendNextPacketIfNotBusy()
+        packetsToSend.push_back(packet);
+
+        sendNextPacketIfNotBusy();
+    }
+
+    // The client's reading slower than we're queueing. Rather than letting the queue grow, drop it and have
+    // the client catch up with a resync. It'll still get everything that's already been written, so by the
+    // time it gets to the resync its game will be at firstFrameToSend; the resync's a delta from there. With input
+    // delay that can be past the frame the tick's on, in which case the tick waits for it (see planFirstSync).
+    void handleLaggard()
     {
-        if (!sending && packetsToSend.size() > 0)
+        if (state != UpToDate || stats.laggardResyncs >= MAX_LAGGARD_RESYNCS)
         {
-            sending = true;
-            boost::asio::async_write(*socket,
-                                     boost::asio::buffer(*(packetsToSend[0])),
-                                     boost::bind(&ClientChannel::wrapUpSendingPacket,
-                                                 this,
-                                                 packetsToSend[0],
-                                                 boost::asio::placeholders::error,
-                                                 boost::asio::placeholders::bytes_transferred));
+            cout << "Client " << connectionAuthdUserAddress << " has " << frameEntriesToSend.size() << " frames (" << queuedBytes << " bytes) queued and can't keep up. Kicking." << endl;
+            close();
+            return;
         }
+
+        cout << "Client " << connectionAuthdUserAddress << " has " << frameEntriesToSend.size() << " frames (" << queuedBytes << " bytes) queued; dropping them for a resync." << endl;
+
+        stats.framesDropped += frameEntriesToSend.size();
+        stats.laggardResyncs++;
+
+        clientBaselineFrame = firstFrameToSend;
+        frameEntriesToSend.clear();
+        queuedBytes = 0;
+        droppingFramesForResync = true;
+
+        // picked up by the next tick, same as a new client
+        state = ReadyForFirstSync;
     }
 
-    void wrapUpSendingPacket(vch *sourceToDispose, const boost::system::error_code &error, size_t bytes_transferred)
+    // Tick thread, every so often for an UpToDate channel (see InputDelayTuner). TCP's already measuring the RTT,
+    // so that's what we go by; it's only read on Linux.
+    void sampleRtt()
     {
-        if (error)
+        pendingOps++;
+        boost::asio::post(strand, boost::bind(&ClientChannel::readRtt, this));
+    }
+    void readRtt()
+    {
+        PendingOp op(this);
+        if (state == Closed)
+            return;
+
+#ifdef __linux__
+        tcp_info info;
+        socklen_t infoSize = sizeof(info);
+        if (getsockopt(socket->native_handle(), IPPROTO_TCP, TCP_INFO, &info, &infoSize) == 0)
         {
-            cout << "Error sending packet to " << connectionAuthdUserAddress << ". Kicking." << endl;
-            state = Closed;
+            rttMicros = info.tcpi_rtt;
+            rttVarMicros = info.tcpi_rttvar;
         }
-        else
-        {
-            assert(packetsToSend[0] == sourceToDispose);
+#endif
+    }
 
-            delete packetsToSend[0];
-            packetsToSend.erase(packetsToSend.begin());
+    bool resyncChunkReady()
+    {
+        return pendingResync && pendingResync->done && resyncChunksSent < pendingResync->chunks.size();
+    }
 
-            sending = false;
+    // Tick thread, every tick while WaitingForResync; the chunks go out one per write from here on.
+    void sendResyncIfReady(boost::shared_ptr<void> sendHold)
+    {
+        pendingOps++;
+        boost::asio::post(strand, boost::bind(&ClientChannel::checkForResyncChunk, this, sendHold));
+    }
+    void checkForResyncChunk(boost::shared_ptr<void> sendHold)
+    {
+        PendingOp op(this);
 
-            sendNextPacketIfNotBusy();
-        }
+        sendNextPacketIfNotBusy();
     }
 
-    void clearVchAndReceiveNextCmd()
+    void sendNextPacketIfNotBusy()
     {
-        receivedBytes = vch(2);
+        if (sending || state == Closed || (!resyncChunkReady() && frameEntriesToSend.size() == 0 && packetsToSend.size() == 0))
+            return;
+
+        boost::shared_ptr<OutgoingWrite> outgoing(new OutgoingWrite);
+
+        for (unsigned int i = 0; i < packetsToSend.size(); i++)
+        {
+            outgoing->packets.push_back(packetsToSend[i]);
+            auto packetBuffers = packetsToSend[i]->asBuffers();
+            outgoing->buffers.insert(outgoing->buffers.end(), packetBuffers.begin(), packetBuffers.end());
+        }
+        packetsToSend.clear();
 
-        async_read(*socket,
-                   boost::asio::buffer(receivedBytes),
-                   boost::bind(&ClientChannel::sizeReceived,
-                               this,
-                               boost::asio::placeholders::error,
-                               boost::asio::placeholders::bytes_transferred));
+        // one chunk per write, so frames never sit behind more than a chunk's worth of resync
+        if (resyncChunkReady())
+        {
+            boost::shared_ptr<const PackedPacket> chunk = pendingResync->chunks[resyncChunksSent++];
+            outgoing->packets.push_back(chunk);
+            auto chunkBuffers = chunk->asBuffers();
+            outgoing->buffers.insert(outgoing->buffers.end(), chunkBuffers.begin(), chunkBuffers.end());
+
+            if (resyncChunksSent == pendingResync->chunks.size())
+            {
+                pendingResync.reset();
+                State expected = WaitingForResync;
+                state.compare_exchange_strong(expected, UpToDate);
+            }
+        }
+
+        for (size_t start = 0; start < frameEntriesToSend.size(); start += MAX_FRAMES_PER_BATCH)
+        {
+            size_t end = min(start + MAX_FRAMES_PER_BATCH, frameEntriesToSend.size());
+            vector<boost::shared_ptr<const vch>> batchEntries(frameEntriesToSend.begin() + start, frameEntriesToSend.begin() + end);
+
+            boost::shared_ptr<const PackedFrameBatch> batch(new PackedFrameBatch(firstFrameToSend + start, batchEntries));
+            outgoing->batches.push_back(batch);
+            outgoing->buffers.insert(outgoing->buffers.end(), batch->asBuffers().begin(), batch->asBuffers().end());
+        }
+        frameEntriesToSend.clear();
+        queuedBytes = 0;
+
+        sending = true;
+#ifdef HAVE_IO_URING
+        if (uring)
+        {
+            uringSendAsync(outgoing, 0);
+            return;
+        }
+#endif
+        pendingOps++;
+        boost::asio::async_write(*socket,
+                                 outgoing->buffers,
+                                 boost::asio::bind_executor(strand,
+                                                            makeCustomAllocHandler(writeHandlerMemory,
+                                                                                   boost::bind(&ClientChannel::wrapUpSendingPacket,
+                                                                                               this,
+                                                                                               outgoing,
+                                                                                               boost::asio::placeholders::error,
+                                                                                               boost::asio::placeholders::bytes_transferred))));
     }
-    void sizeReceived(const boost::system::error_code &error, size_t transferred)
+
+    void wrapUpSendingPacket(boost::shared_ptr<OutgoingWrite> sent, const boost::system::error_code &error, size_t bytes_transferred)
     {
+        PendingOp op(this);
+        if (state == Closed)
+            return;
+
         if (error)
         {
-            cout << "Error receiving cmd size from " << connectionAuthdUserAddress << ": " << error.message() << endl << "Kicking." << endl;
-            state = Closed;
+            cout << "Error sending packet to " << connectionAuthdUserAddress << ". Kicking." << endl;
+            close();
         }
         else
         {
-            vchIter place = receivedBytes.begin();
+            sending = false;
+            stats.bytesSent += bytes_transferred;
+            stats.writes++;
+
+            sendNextPacketIfNotBusy();
+        }
+    }
 
-            uint16_t size;
-            unpackFromIter(place, "H", &size);
+    // Takes every whole cmd we've got. Returns how much more of the next one we need, if it's partway in.
+    size_t handleReceivedCmds()
+    {
+        while (receiveBuffer.size() >= 2)
+        {
+            uint16_t size = VchReader(receiveBuffer.data(), 2).get<uint16_t>();
+            if (receiveBuffer.size() < 2 + (size_t)size)
+                return 2 + size - receiveBuffer.size();
 
-            clearVchAndReceiveCmdBody(size);
+            handleCmd(receiveBuffer.data() + 2, size);
+            receiveBuffer.consume(2 + size);
         }
+        return 0;
     }
-    void clearVchAndReceiveCmdBody(uint16_t size)
+    void handleCmd(const unsigned char *data, size_t size)
     {
-        receivedBytes = vch(size);
+        VchReader reader(data, size);
+
+        boost::shared_ptr<Cmd> cmd = unpackFullCmdAndMoveIter(&reader);
+        if (!reader.ok() || !reader.atEnd())
+        {
+            // the size prefix was fine, so the stream's still in step; just drop the cmd
+            cout << "Dropping malformed cmd from " << connectionAuthdUserAddress << " (" << (reader.ok() ? "trailing bytes" : reader.getErrorString()) << ")" << endl;
+            return;
+        }
 
-        async_read(*socket,
-                   boost::asio::buffer(receivedBytes),
-                   boost::bind(&ClientChannel::cmdBodyReceived,
-                               this,
-                               boost::asio::placeholders::error,
-                               boost::asio::placeholders::bytes_transferred));
+        receivedCmds.push(ReceivedCmd{cmd, connectionAuthdUserAddress});
     }
-    void cmdBodyReceived(const boost::system::error_code &error, size_t transferred)
+
+#ifdef HAVE_IO_URING
+    // One multishot receive for the rest of the connection, unless the kernel runs out of buffers for it. Its
+    // completions are reaped on any network thread and posted over to the strand, in order. It counts as a
+    // pending op itself until its last completion.
+    void uringReceiveAsync()
     {
-        if (error)
+        pendingOps++;
+        uring->recvMultishot(socket->native_handle(), [this](int result, uint32_t flags)
+        {
+            pendingOps++;
+            boost::asio::post(strand, makeCustomAllocHandler(receiveHandlerMemory, boost::bind(&ClientChannel::uringBytesReceived, this, result, flags)));
+            if (!(flags & IORING_CQE_F_MORE))
+                pendingOps--;
+        });
+    }
+    void uringBytesReceived(int result, uint32_t flags)
+    {
+        PendingOp op(this);
+
+        if (flags & IORING_CQE_F_BUFFER)
         {
-            cout << "Error receiving cmd body from " << connectionAuthdUserAddress << ". Kicking." << endl;
-            state = Closed;
+            uint16_t bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (state != Closed && result > 0)
+            {
+                memcpy(receiveBuffer.prepare(result).data(), uring->recvBuffer(bufferId), result);
+                receiveBuffer.commit(result);
+            }
+            uring->recycleRecvBuffer(bufferId);
         }
-        else
+
+        if (state == Closed)
+            return;
+
+        if (result == 0 || (result < 0 && result != -ENOBUFS))
         {
-            vchIter place = receivedBytes.begin();
+            cout << "Error receiving cmds from " << connectionAuthdUserAddress << ": " << (result == 0 ? string("connection closed") : string(strerror(-result))) << endl << "Kicking." << endl;
+            close();
+            return;
+        }
 
-            boost::shared_ptr<Cmd> cmd = unpackFullCmdAndMoveIter(&place);
-            boost::shared_ptr<AuthdCmd> authdCmd = boost::shared_ptr<AuthdCmd>(new AuthdCmd(cmd, this->connectionAuthdUserAddress));
+        if (result > 0)
+            handleReceivedCmds();
 
-            pendingCmds.push_back(authdCmd);
+        // out of buffers, or the kernel just decided to end it
+        if (!(flags & IORING_CQE_F_MORE))
+            uringReceiveAsync();
+    }
 
-            clearVchAndReceiveNextCmd();
+    // The send can come up short, in which case the rest goes in another.
+    void uringSendAsync(boost::shared_ptr<OutgoingWrite> outgoing, size_t sentSoFar)
+    {
+        vector<boost::asio::const_buffer> remaining;
+        size_t skip = sentSoFar;
+        for (unsigned int i = 0; i < outgoing->buffers.size(); i++)
+        {
+            if (skip >= outgoing->buffers[i].size())
+            {
+                skip -= outgoing->buffers[i].size();
+                continue;
+            }
+            remaining.push_back(outgoing->buffers[i] + skip);
+            skip = 0;
         }
+
+        pendingOps++;
+        uring->sendmsg(socket->native_handle(), remaining, [this, outgoing, sentSoFar](int result, uint32_t flags)
+        {
+            boost::asio::post(strand, makeCustomAllocHandler(writeHandlerMemory, boost::bind(&ClientChannel::uringSent, this, outgoing, sentSoFar, result)));
+        });
     }
+    // Its pending op is handed on to wrapUpSendingPacket, unless there's more to send.
+    void uringSent(boost::shared_ptr<OutgoingWrite> sent, size_t sentSoFar, int result)
+    {
+        if (state != Closed && result > 0)
+        {
+            sentSoFar += result;
+            if (sentSoFar < boost::asio::buffer_size(sent->buffers))
+            {
+                uringSendAsync(sent, sentSoFar);
+                pendingOps--;
+                return;
+            }
+        }
+
+        boost::system::error_code error;
+        if (result <= 0)
+            error = boost::system::error_code(result == 0 ? EPIPE : -result, boost::system::system_category());
+        wrapUpSendingPacket(sent, error, sentSoFar);
+    }
+#endif
 };
 
 void Listener::handleAccept(boost::shared_ptr<tcp::socket> socket, const boost::system::error_code &error)
@@ -328,18 +1034,40 @@ void Listener::handleAccept(boost::shared_ptr<tcp::socket> socket, const boost::
     {
         throw("Listener error accepting:" + error.value());
     }
+    else if (handshakesInProgress >= MAX_PENDING_HANDSHAKES)
+    {
+        cout << "Turning away a connection; " << handshakesInProgress << " handshakes already in progress." << endl;
+        boost::system::error_code ignored;
+        socket->close(ignored);
+    }
     else
     {
         cout << "client connected!" << endl;
-        ClientChannel *clientChannel = new ClientChannel(ioService, socket);
-        clientChannel->startHandshakeAsync();
-        
-        clientChannels.push_back(clientChannel);
-
+        handshakesInProgress++;
+        acceptedSockets.push(socket);
     }
     startAccept();
 }
 
+// Tick thread. Reuses an idle channel if there is one.
+void startChannel(boost::asio::io_service &ioService, boost::shared_ptr<tcp::socket> socket)
+{
+    ClientChannel *clientChannel;
+    if (idleChannels.size() > 0)
+    {
+        clientChannel = idleChannels.back();
+        idleChannels.pop_back();
+        clientChannel->reset(socket);
+    }
+    else
+    {
+        clientChannel = new ClientChannel(ioService, socket);
+    }
+    clientChannel->startServing();
+
+    clientChannels.push_back(clientChannel);
+}
+
 struct WithdrawEvent
 {
     string userAddress;
@@ -348,7 +1076,7 @@ struct WithdrawEvent
         : userAddress(userAddress), amountInCoins(amountInCoins) {}
     boost::shared_ptr<Event> toEventSharedPtr()
     {
-        return boost::shared_ptr<Event>(new BalanceUpdateEvent(userAddress, amountInCoins, false));
+        return boost::shared_ptr<Event>(new BalanceUpdateEvent(&game, userAddress, amountInCoins, false));
     }
 };
 
@@ -400,7 +1128,7 @@ vector<boost::shared_ptr<Event>> pollPendingDepositsAndHoneypotEvents()
                     }
                     else
                     {
-                        events.push_back(boost::shared_ptr<Event>(new BalanceUpdateEvent(userAddressOrHoneypotString, depositInCoins, true)));
+                        events.push_back(boost::shared_ptr<Event>(new BalanceUpdateEvent(&game, userAddressOrHoneypotString, depositInCoins, true)));
                     }
                 }
             }
@@ -417,39 +1145,325 @@ vector<boost::shared_ptr<Event>> pollPendingDepositsAndHoneypotEvents()
     return events;
 }
 
+// Paces the tick loop off a steady_timer, so the tick thread sleeps between ticks, and keeps it from falling
+// further and further behind when ticks run long. See MAX_CATCHUP_TICKS and the slowdown settings in config.h.
+class TickScheduler
+{
+    typedef chrono::steady_clock::time_point TimePoint;
+    typedef chrono::steady_clock::duration Duration;
+
+    boost::asio::steady_timer timer;
+    const Duration baseInterval;
+    Duration interval;
+    unsigned int slowdownSteps;
+    TimePoint nextTick;
+    TimePoint tickStart;
+
+    // over about TICK_LOAD_SMOOTHING ticks
+    double averageWorkSeconds;
+    TimePoint nextSlowdownChangeAllowed;
+
+    TimePoint statsStart;
+    uint64_t statsTicks;
+    Duration statsTotalWork;
+    Duration statsMaxWork;
+    Duration statsMaxLag;
+    uint64_t statsLateTicks;
+    uint64_t statsSkippedTicks;
+
+    void resetStats(TimePoint now)
+    {
+        statsStart = now;
+        statsTicks = 0;
+        statsTotalWork = statsMaxWork = statsMaxLag = Duration::zero();
+        statsLateTicks = statsSkippedTicks = 0;
+    }
+
+    void logStats(TimePoint now)
+    {
+        double msPerTick = statsTicks > 0 ? chrono::duration<double, milli>(statsTotalWork).count() / statsTicks : 0;
+        cout << "Ticks: " << statsTicks << " in " << chrono::duration<double>(now - statsStart).count() << "s, "
+             << "work avg " << msPerTick << "ms max " << chrono::duration<double, milli>(statsMaxWork).count() << "ms, "
+             << statsLateTicks << " late (max " << chrono::duration<double, milli>(statsMaxLag).count() << "ms), "
+             << statsSkippedTicks << " skipped, interval " << chrono::duration<double, milli>(interval).count() << "ms" << endl;
+    }
+
+    void adjustSlowdown(TimePoint now)
+    {
+        if (!ALLOW_TICK_SLOWDOWN || now < nextSlowdownChangeAllowed)
+            return;
+
+        double load = averageWorkSeconds / chrono::duration<double>(interval).count();
+        if (load > TICK_OVERLOAD_LOAD && slowdownSteps < MAX_TICK_SLOWDOWN_STEPS)
+            slowdownSteps++;
+        else if (load < TICK_RECOVER_LOAD && slowdownSteps > 0)
+            slowdownSteps--;
+        else
+            return;
+
+        interval = baseInterval * (4 + slowdownSteps) / 4;
+        nextSlowdownChangeAllowed = now + TICK_SLOWDOWN_COOLDOWN;
+
+        cout << "Tick load " << load << "; tick interval now " << chrono::duration<double, milli>(interval).count() << "ms" << endl;
+    }
+
+public:
+    TickScheduler(boost::asio::io_service &ioService)
+        : timer(ioService), baseInterval(chrono::duration_cast<Duration>(ONE_FRAME)), interval(baseInterval), slowdownSteps(0),
+          averageWorkSeconds(0)
+    {
+        TimePoint now = chrono::steady_clock::now();
+        nextTick = now;
+        nextSlowdownChangeAllowed = now;
+        resetStats(now);
+    }
+
+    Duration getInterval()
+    {
+        return interval;
+    }
+
+    // Sleeps until it's time for the next tick.
+    void waitForNextTick()
+    {
+        TimePoint now = chrono::steady_clock::now();
+        if (now - nextTick > interval * MAX_CATCHUP_TICKS)
+        {
+            // too far behind to catch up; the game just runs that much behind real time
+            statsSkippedTicks += (now - nextTick) / interval;
+            nextTick = now;
+        }
+
+        timer.expires_at(nextTick);
+        timer.wait();
+
+        tickStart = chrono::steady_clock::now();
+        Duration lag = tickStart - nextTick;
+        statsMaxLag = max(statsMaxLag, lag);
+        if (lag > interval)
+            statsLateTicks++;
+
+        nextTick += interval;
+    }
+
+    void tickDone()
+    {
+        TimePoint now = chrono::steady_clock::now();
+        Duration work = now - tickStart;
+
+        statsTicks++;
+        statsTotalWork += work;
+        statsMaxWork = max(statsMaxWork, work);
+
+        averageWorkSeconds += (chrono::duration<double>(work).count() - averageWorkSeconds) / TICK_LOAD_SMOOTHING;
+        adjustSlowdown(now);
+
+        if (now - statsStart >= TICK_STATS_INTERVAL)
+        {
+            logStats(now);
+            resetStats(now);
+        }
+    }
+};
+
+// Picks the input delay (see config.h) from the clients' RTT samples: enough to cover INPUT_DELAY_JITTER_FACTOR
+// times the RTT variation of the INPUT_DELAY_PERCENTILE'th client, so one client on a bad link doesn't put everyone
+// else behind. Moves a frame at a time, and holds still while there's nobody to go by. Tick thread only.
+class InputDelayTuner
+{
+    typedef chrono::steady_clock::time_point TimePoint;
+
+    unsigned int delay;
+    TimePoint nextRetune;
+    vector<uint32_t> rttSamples;
+    vector<uint32_t> rttVarSamples;
+
+    // the INPUT_DELAY_PERCENTILE'th of samples, which it reorders
+    uint32_t percentile(vector<uint32_t> &samples)
+    {
+        size_t index = min(samples.size() - 1, (size_t)(samples.size() * INPUT_DELAY_PERCENTILE));
+        nth_element(samples.begin(), samples.begin() + index, samples.end());
+        return samples[index];
+    }
+
+public:
+    InputDelayTuner()
+        : delay(MIN_INPUT_DELAY), nextRetune(chrono::steady_clock::now() + INPUT_DELAY_TUNE_INTERVAL) {}
+
+    unsigned int getDelay()
+    {
+        return delay;
+    }
+
+    bool dueForRetune()
+    {
+        return chrono::steady_clock::now() >= nextRetune;
+    }
+
+    // in microseconds, as ClientChannel has them
+    void addSample(uint32_t rtt, uint32_t rttVar)
+    {
+        rttSamples.push_back(rtt);
+        rttVarSamples.push_back(rttVar);
+    }
+
+    // Goes by the samples added since the last one. Returns whether the delay changed.
+    bool retune(chrono::steady_clock::duration tickInterval)
+    {
+        nextRetune = chrono::steady_clock::now() + INPUT_DELAY_TUNE_INTERVAL;
+        if (rttVarSamples.size() == 0)
+            return false;
+
+        uint32_t rtt = percentile(rttSamples);
+        uint32_t rttVar = percentile(rttVarSamples);
+        size_t numSamples = rttVarSamples.size();
+        rttSamples.clear();
+        rttVarSamples.clear();
+
+        double tickMicros = chrono::duration<double, micro>(tickInterval).count();
+        unsigned int wanted = (unsigned int)ceil(rttVar * INPUT_DELAY_JITTER_FACTOR / tickMicros);
+        wanted = max(MIN_INPUT_DELAY, min(wanted, MAX_INPUT_DELAY));
+
+        if (wanted > delay)
+            delay++;
+        else if (wanted < delay)
+            delay--;
+        else
+            return false;
+
+        cout << "Input delay now " << delay << " frames (RTT " << rtt / 1000.0 << "ms +/- " << rttVar / 1000.0 << "ms over "
+             << numSamples << " clients)" << endl;
+
+        return true;
+    }
+};
+
 int main(int argc, char *argv[])
 {
     srand(time(0));
 
     boost::asio::io_service io_service;
 
+    // --io-uring: do the clients' steady-state socket I/O through io_uring rather than asio (Linux only)
+    for (int i = 1; i < argc; i++)
+    {
+        if (string(argv[i]) == "--io-uring")
+        {
+#ifdef HAVE_IO_URING
+            try
+            {
+                uring = new IoUring(io_service, URING_ENTRIES, URING_RECV_BUFFERS, URING_RECV_BUFFER_SIZE);
+                cout << "Using io_uring for client I/O." << endl;
+            }
+            catch (runtime_error &e)
+            {
+                cout << "Couldn't set up io_uring (" << e.what() << "); using asio." << endl;
+            }
+#else
+            cout << "This build doesn't have io_uring; using asio." << endl;
+#endif
+        }
+    }
+
+    boost::asio::thread_pool authThreads(AUTH_THREADS);
+    authPool = &authThreads;
+
     Listener listener(io_service);
     listener.startAccept();
 
+    // all socket work happens on these; the loop below just runs the game
+    boost::asio::io_service::work keepRunning(io_service);
+    unsigned int numNetworkThreads = max(1u, min(thread::hardware_concurrency(), MAX_NETWORK_THREADS));
+    vector<thread> networkThreads;
+    for (unsigned int i = 0; i < numNetworkThreads; i++)
+    {
+        networkThreads.push_back(thread([&io_service] { io_service.run(); }));
+    }
+
     // server will scan this directory for pending deposits (supplied by py/balance_tracker.py)
     boost::filesystem::path accountingDirPath("./accounting/pending_deposits/");
     boost::filesystem::directory_iterator directoryEndIter; // default constructor makes it an end_iter
 
-    chrono::time_point<chrono::system_clock, chrono::duration<double>> nextFrameStart(chrono::system_clock::now());
+    // only for its timer; nothing runs on it
+    boost::asio::io_service tickService;
+    TickScheduler tickScheduler(tickService);
+
+    // goes to every client whenever the tick interval changes, and to new ones if it isn't ONE_FRAME
+    chrono::steady_clock::duration announcedTickInterval = tickScheduler.getInterval();
+    boost::shared_ptr<const PackedPacket> tickIntervalPacket;
+
+    // goes to every client whenever the input delay changes, and to every new one
+    InputDelayTuner inputDelayTuner;
+    boost::shared_ptr<const PackedPacket> inputDelayPacket;
+
+    FrameHistory frameHistory;
+    vector<boost::shared_ptr<const vch>> missedEntries;
+
+    // frames scheduled but not run yet, from game.frame on
+    deque<FrameEventsPacket> scheduledFrames;
+    uint64_t nextFrameToSchedule = game.frame;
+    vector<boost::shared_ptr<const vch>> newEntries; // this tick's, from firstNewFrame on
 
     vector<WithdrawEvent> pendingWithdrawEvents;
+    vector<boost::shared_ptr<AuthdCmd>> pendingCmds;
+    vector<boost::shared_ptr<Event>> pendingEvents;
     
     while (true)
     {
-        // poll io_service, which will populate pendingCmds with anything the ClientChannels have received
-        io_service.poll();
+        tickScheduler.waitForNextTick();
+
+        bool tickIntervalChanged = tickScheduler.getInterval() != announcedTickInterval;
+        if (tickIntervalChanged)
+        {
+            announcedTickInterval = tickScheduler.getInterval();
+
+            vch body;
+            VchWriter(&body).putVarint(chrono::duration_cast<chrono::microseconds>(announcedTickInterval).count());
+            tickIntervalPacket.reset(new PackedPacket(PACKET_TICKINTERVAL_CHAR, body));
+        }
+        bool tickIntervalIsBase = announcedTickInterval == chrono::duration_cast<chrono::steady_clock::duration>(ONE_FRAME);
+
+        // re-tuned from the RTTs sampled last time round, and the next ones are asked for
+        bool inputDelayChanged = !inputDelayPacket;
+        if (inputDelayTuner.dueForRetune())
+        {
+            for (unsigned int i = 0; i < clientChannels.size(); i++)
+            {
+                if (clientChannels[i]->state != ClientChannel::UpToDate)
+                    continue;
 
-        // rate limit iteration to a maximum of SEC_PER_FRAME
-        chrono::time_point<chrono::system_clock, chrono::duration<double>> now(chrono::system_clock::now());
-        if (now < nextFrameStart)
-            continue;
-        nextFrameStart += ONE_FRAME;
+                if (clientChannels[i]->rttMicros != 0)
+                    inputDelayTuner.addSample(clientChannels[i]->rttMicros, clientChannels[i]->rttVarMicros);
+                clientChannels[i]->sampleRtt();
+            }
+            if (inputDelayTuner.retune(tickScheduler.getInterval()))
+                inputDelayChanged = true;
+        }
+        if (inputDelayChanged)
+        {
+            vch body;
+            VchWriter(&body).putVarint(inputDelayTuner.getDelay());
+            inputDelayPacket.reset(new PackedPacket(PACKET_INPUTDELAY_CHAR, body));
+        }
+
+        boost::shared_ptr<tcp::socket> acceptedSocket;
+        while (acceptedSockets.pop(&acceptedSocket))
+        {
+            startChannel(io_service, acceptedSocket);
+        }
 
-        // let's count up events
-        vector<boost::shared_ptr<Event>> pendingEvents;
+        // Cmds go out tagged with the sender's player index. Anyone who hasn't deposited yet
+        // isn't a player, and their cmds would be ignored anyway.
+        ReceivedCmd receivedCmd;
+        while (receivedCmds.pop(&receivedCmd))
+        {
+            int playerId = game.playerAddressToIdOrNegativeOne(receivedCmd.userAddress);
+            if (playerId != -1)
+                pendingCmds.push_back(boost::shared_ptr<AuthdCmd>(new AuthdCmd(receivedCmd.cmd, playerId)));
+        }
 
         // did we see any withdrawals last loop?
-        // If so, actuate and queue for in-game processing
+        // If so, queue for in-game processing; they're paid out once that happens
         for (uint i=0; i<pendingWithdrawEvents.size(); i++)
         {
             // just make sure again the math works out
@@ -459,7 +1473,6 @@ int main(int argc, char *argv[])
             }
             else
             {
-                actuateWithdrawal(pendingWithdrawEvents[i].userAddress, pendingWithdrawEvents[i].amountInCoins);
                 pendingEvents.push_back(pendingWithdrawEvents[i].toEventSharedPtr());
             }
         }
@@ -469,9 +1482,31 @@ int main(int argc, char *argv[])
         vector<boost::shared_ptr<Event>> depositAndHoneypotEvents = pollPendingDepositsAndHoneypotEvents();
         pendingEvents.insert(pendingEvents.end(), depositAndHoneypotEvents.begin(), depositAndHoneypotEvents.end());
 
-        // build FrameEventsPacket for this frame
-        // includes all cmds we've received from clients since last time and all new events
-        FrameEventsPacket fcp(game.frame, pendingCmds, pendingEvents);
+        // Everything we've received since last time goes in the frame the input delay from now, and every frame
+        // up to there goes out now. When the delay's just gone up, that's an extra (empty) frame; when it's just
+        // gone down, there's none, and it all waits for the next tick.
+        uint64_t firstNewFrame = nextFrameToSchedule;
+        newEntries.clear();
+        while (nextFrameToSchedule <= game.frame + inputDelayTuner.getDelay())
+        {
+            scheduledFrames.push_back(FrameEventsPacket(nextFrameToSchedule, pendingCmds, pendingEvents));
+            pendingCmds.clear();
+            pendingEvents.clear();
+
+            // serialize it once; every channel's batch shares the same bytes
+            boost::shared_ptr<const vch> entry = packFrameBatchEntry(&scheduledFrames.back());
+            frameHistory.add(nextFrameToSchedule, entry);
+            newEntries.push_back(entry);
+
+            nextFrameToSchedule++;
+        }
+
+        // with io_uring, the sends below all go in one submit once every channel's handled its share
+        boost::shared_ptr<void> sendHold;
+#ifdef HAVE_IO_URING
+        if (uring)
+            sendHold = uring->holdSubmits();
+#endif
 
         // send the packet out to all clients
         for (unsigned int i = 0; i < clientChannels.size(); i++)
@@ -482,64 +1517,144 @@ int main(int argc, char *argv[])
                     break;
 
                 case ClientChannel::ReadyForFirstSync:
-                    clientChannels[i]->sendResyncPacket();
-                    clientChannels[i]->sendFrameCmdsPacket(fcp);
+                {
+                    // a client that was only gone a moment just gets what it missed, up to the last frame scheduled
+                    bool historyCoversBaseline = clientChannels[i]->clientBaselineFrame != 0 && frameHistory.getSince(clientChannels[i]->clientBaselineFrame, &missedEntries);
+                    FirstSyncPlan plan = planFirstSync(clientChannels[i]->clientBaselineFrame, historyCoversBaseline, game.frame, nextFrameToSchedule);
+                    if (plan.action == WaitForBaseline)
+                        break;
+
+                    if (tickIntervalPacket && (tickIntervalChanged || !tickIntervalIsBase))
+                        clientChannels[i]->queuePacket(tickIntervalPacket, sendHold);
+                    clientChannels[i]->queuePacket(inputDelayPacket, sendHold);
+
+                    if (plan.action == CatchUpFromHistory)
+                    {
+                        clientChannels[i]->startCatchUp(missedEntries);
+                        break;
+                    }
+
+                    // Resync is packed off-thread; frames go out meanwhile, starting with the ones already scheduled
+                    // past it, and the client holds onto them until the last resync chunk is in. If those don't fit
+                    // under the queue caps there's no syncing it.
+                    if (!frameHistory.getSince(game.frame, &missedEntries))
+                    {
+                        clientChannels[i]->kick("can't be sent the frames scheduled past the resync");
+                        break;
+                    }
+                    clientChannels[i]->startResync(resyncPacker.getJobForCurrentFrame(&game, plan.resyncBaseline));
+                    for (unsigned int j = 0; j < missedEntries.size(); j++)
+                    {
+                        clientChannels[i]->queueFrame(game.frame + j, missedEntries[j], sendHold);
+                    }
+                    clientChannels[i]->sendResyncIfReady(sendHold);
+                    break;
+                }
 
-                    clientChannels[i]->state = ClientChannel::UpToDate;
+                case ClientChannel::WaitingForResync:
+                    if (tickIntervalChanged)
+                        clientChannels[i]->queuePacket(tickIntervalPacket, sendHold);
+                    if (inputDelayChanged)
+                        clientChannels[i]->queuePacket(inputDelayPacket, sendHold);
+
+                    for (unsigned int j = 0; j < newEntries.size(); j++)
+                    {
+                        clientChannels[i]->queueFrame(firstNewFrame + j, newEntries[j], sendHold);
+                    }
+                    clientChannels[i]->sendResyncIfReady(sendHold);
                     break;
 
                 case ClientChannel::UpToDate:
-                    clientChannels[i]->sendFrameCmdsPacket(fcp);
+                    if (tickIntervalChanged)
+                        clientChannels[i]->queuePacket(tickIntervalPacket, sendHold);
+                    if (inputDelayChanged)
+                        clientChannels[i]->queuePacket(inputDelayPacket, sendHold);
+
+                    for (unsigned int j = 0; j < newEntries.size(); j++)
+                    {
+                        clientChannels[i]->queueFrame(firstNewFrame + j, newEntries[j], sendHold);
+                    }
                     break;
                 
                 case ClientChannel::Closed:
-                    clientChannels.erase(clientChannels.begin()+i);
-                    i--;
+                    // handlers aborted by the close still point at it; wait for them before letting it go
+                    if (clientChannels[i]->readyToRecycle())
+                    {
+                        clientChannels[i]->releaseSocket();
+                        if (idleChannels.size() < MAX_IDLE_CHANNELS)
+                            idleChannels.push_back(clientChannels[i]);
+                        else
+                            delete clientChannels[i];
+
+                        clientChannels.erase(clientChannels.begin()+i);
+                        i--;
+                    }
                     break;
             }
         }
+        sendHold.reset(); // the channels' copies are all that's holding it now
+
+        // now run the frame that was scheduled for this one
+        FrameEventsPacket &frameToRun = scheduledFrames.front();
+        assert(frameToRun.frame == game.frame);
 
         // execute all events
-        for (unsigned int i = 0; i < pendingEvents.size(); i++)
+        for (unsigned int i = 0; i < frameToRun.events.size(); i++)
         {
-            pendingEvents[i]->execute(&game);
+            // A withdrawal's paid out only now: the player might've spent the coins since it was scheduled, in
+            // which case the event doesn't take them (on the clients either) and there's nothing to pay.
+            auto balanceUpdate = boost::dynamic_pointer_cast<BalanceUpdateEvent, Event>(frameToRun.events[i]);
+            if (balanceUpdate && !balanceUpdate->isDeposit)
+            {
+                int playerId = balanceUpdate->playerIdOrNegativeOne;
+                if (playerId == -1)
+                    playerId = game.playerAddressToIdOrNegativeOne(balanceUpdate->userAddress);
+
+                if (playerId != -1 && playerId < (int)game.players.size() && balanceUpdate->amount <= game.players[playerId].credit.getInt())
+                    actuateWithdrawal(game.playerIdToAddress(playerId), balanceUpdate->amount);
+                else
+                    cout << "Withdrawal of " << balanceUpdate->amount << " by player " << playerId << " isn't covered anymore; dropping it." << endl;
+            }
+
+            frameToRun.events[i]->execute(&game);
         }
-        pendingEvents.clear();
 
         // execute all cmds on server-side game
-        for (unsigned int i = 0; i < pendingCmds.size(); i++)
+        vector<boost::shared_ptr<AuthdCmd>> &cmdsToRun = frameToRun.authdCmds;
+        for (unsigned int i = 0; i < cmdsToRun.size(); i++)
         {
-            auto cmd = pendingCmds[i]->cmd;
+            auto cmd = cmdsToRun[i]->cmd;
             if (auto unitCmd = boost::dynamic_pointer_cast<UnitCmd, Cmd>(cmd))
             {
-                unitCmd->executeAsPlayer(&game, pendingCmds[i]->playerAddress);
+                unitCmd->executeAsPlayer(&game, cmdsToRun[i]->playerId);
             }
             else if (auto spawnBeaconCmd = boost::dynamic_pointer_cast<SpawnBeaconCmd, Cmd>(cmd))
             {
-                spawnBeaconCmd->executeAsPlayer(&game, pendingCmds[i]->playerAddress);
+                spawnBeaconCmd->executeAsPlayer(&game, cmdsToRun[i]->playerId);
             }
-            else if (auto withdrawCmd = boost::dynamic_pointer_cast<WithdrawCmd, Cmd>(pendingCmds[i]->cmd))
+            else if (auto setControlGroupCmd = boost::dynamic_pointer_cast<SetControlGroupCmd, Cmd>(cmd))
             {
-                int playerId = game.playerAddressToIdOrNegativeOne(pendingCmds[i]->playerAddress);
-                if (playerId < 0)
-                {
-                    cout << "Woah, getting a negative playerId when processing a withdraw cmd..." << endl;
-                    continue;
-                }
+                setControlGroupCmd->executeAsPlayer(&game, cmdsToRun[i]->playerId);
+            }
+            else if (auto withdrawCmd = boost::dynamic_pointer_cast<WithdrawCmd, Cmd>(cmdsToRun[i]->cmd))
+            {
+                uint32_t playerId = cmdsToRun[i]->playerId;
                 // if 0, interpret this as "all"
                 coinsInt withdrawSpecified = withdrawCmd->amount > 0 ? withdrawCmd->amount : game.players[playerId].credit.getInt();
                 coinsInt amountToWithdraw = min(withdrawSpecified, game.players[playerId].credit.getInt());
 
-                pendingWithdrawEvents.push_back(WithdrawEvent(pendingCmds[i]->playerAddress, amountToWithdraw));
+                pendingWithdrawEvents.push_back(WithdrawEvent(game.playerIdToAddress(playerId), amountToWithdraw));
             }
             else
             {
                 cout << "Woah, I don't know how to handle that cmd as a server!" << endl;
             }
         }
-        pendingCmds.clear();
+        scheduledFrames.pop_front();
 
         game.iterate();
+
+        tickScheduler.tickDone();
     }
 
     cout << "oohhhhh Logan you done did it this time" << endl;
@@ -1,53 +1,228 @@
-#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <secp256k1.h>
+#include <secp256k1_recovery.h>
 #include "sigWrapper.h"
 
 using namespace std;
 
-string getPythonErrorText()
+// Keccak-f[1600], after the reference implementation's compact version.
+
+const uint64_t KECCAK_ROUND_CONSTANTS[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL, 0x8000000080008000ULL,
+    0x000000000000808bULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008aULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+    0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800aULL, 0x800000008000000aULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+const unsigned int KECCAK_ROTATIONS[24] = {
+    1, 3, 6, 10, 15, 21, 28, 36, 45, 55, 2, 14, 27, 41, 56, 8, 25, 43, 62, 18, 39, 61, 20, 44
+};
+const unsigned int KECCAK_PI_LANES[24] = {
+    10, 7, 11, 17, 18, 3, 5, 16, 8, 21, 24, 4, 15, 23, 19, 13, 12, 2, 20, 14, 22, 9, 6, 1
+};
+
+uint64_t rotl64(uint64_t x, unsigned int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+void keccakF1600(uint64_t state[25])
 {
-    PyObject *ptype, *pvalue, *ptraceback;
-    PyErr_Fetch(&ptype, &pvalue, &ptraceback);
-    if (pvalue)
+    for (unsigned int round = 0; round < 24; round++)
+    {
+        // theta
+        uint64_t c[5];
+        for (unsigned int x = 0; x < 5; x++)
         {
-        PyObject *pstr = PyObject_Str(pvalue);
-        if (pstr)
+            c[x] = state[x] ^ state[x + 5] ^ state[x + 10] ^ state[x + 15] ^ state[x + 20];
+        }
+        for (unsigned int x = 0; x < 5; x++)
         {
-            const char* err_msg = PyUnicode_AsUTF8(pstr);
-            if(pstr)
-            return string(err_msg);
+            uint64_t d = c[(x + 4) % 5] ^ rotl64(c[(x + 1) % 5], 1);
+            for (unsigned int y = 0; y < 25; y += 5)
+            {
+                state[y + x] ^= d;
+            }
         }
+
+        // rho and pi
+        uint64_t carried = state[1];
+        for (unsigned int i = 0; i < 24; i++)
+        {
+            unsigned int lane = KECCAK_PI_LANES[i];
+            uint64_t next = state[lane];
+            state[lane] = rotl64(carried, KECCAK_ROTATIONS[i]);
+            carried = next;
+        }
+
+        // chi
+        for (unsigned int y = 0; y < 25; y += 5)
+        {
+            uint64_t row[5];
+            for (unsigned int x = 0; x < 5; x++)
+            {
+                row[x] = state[y + x];
+            }
+            for (unsigned int x = 0; x < 5; x++)
+            {
+                state[y + x] = row[x] ^ (~row[(x + 1) % 5] & row[(x + 2) % 5]);
+            }
+        }
+
+        // iota
+        state[0] ^= KECCAK_ROUND_CONSTANTS[round];
     }
-    return "... but I can't get the error string for some reason :/";
 }
 
-optional<string> signedMsgToAddress(string message, string sig, string *error)
+// lanes are little-endian
+void keccakAbsorbBlock(uint64_t state[25], const unsigned char *block, size_t rate)
 {
-    Py_Initialize();
+    for (size_t i = 0; i < rate / 8; i++)
+    {
+        uint64_t lane = 0;
+        for (unsigned int j = 0; j < 8; j++)
+        {
+            lane |= (uint64_t)block[i * 8 + j] << (8 * j);
+        }
+        state[i] ^= lane;
+    }
+    keccakF1600(state);
+}
+
+void keccak256(const unsigned char *data, size_t size, unsigned char *hash)
+{
+    const size_t rate = 136; // 1600 bits, less twice the output
+    uint64_t state[25] = {};
 
-    PyRun_SimpleString("import sys, os");
-    PyRun_SimpleString("sys.path.append(os.getcwd())");
+    for (; size >= rate; data += rate, size -= rate)
+    {
+        keccakAbsorbBlock(state, data, rate);
+    }
 
-    PyObject* module = PyImport_ImportModule("signed_msg_to_address");
-    if (!module)
+    unsigned char lastBlock[rate] = {};
+    memcpy(lastBlock, data, size);
+    lastBlock[size] ^= 0x01;
+    lastBlock[rate - 1] ^= 0x80;
+    keccakAbsorbBlock(state, lastBlock, rate);
+
+    for (unsigned int i = 0; i < 32; i++)
     {
-        *error = "Python error: error importing module: " + getPythonErrorText();
+        hash[i] = state[i / 8] >> (8 * (i % 8));
+    }
+}
+
+// Same leniency as web3's HexBytes: an optional 0x, either case, and an odd number of digits gets a leading 0.
+optional<string> hexToBytes(string hex)
+{
+    if (hex.size() >= 2 && hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X'))
+        hex = hex.substr(2);
+    if (hex.size() % 2 != 0)
+        hex = "0" + hex;
+
+    string bytes;
+    for (size_t i = 0; i < hex.size(); i += 2)
+    {
+        int byte = 0;
+        for (size_t j = i; j < i + 2; j++)
+        {
+            char c = hex[j];
+            int nibble;
+            if (c >= '0' && c <= '9')
+                nibble = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                nibble = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                nibble = c - 'A' + 10;
+            else
+                return {};
+            byte = (byte << 4) | nibble;
+        }
+        bytes += (char)byte;
+    }
+    return bytes;
+}
+
+// EIP-55: a hex digit's uppercased if the matching nibble of the hash of the lowercase address is 8 or more.
+string toChecksumAddress(const unsigned char *addressBytes)
+{
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (unsigned int i = 0; i < 20; i++)
+    {
+        hex += digits[addressBytes[i] >> 4];
+        hex += digits[addressBytes[i] & 0xf];
+    }
+
+    unsigned char hash[32];
+    keccak256((const unsigned char *)hex.data(), hex.size(), hash);
+
+    for (unsigned int i = 0; i < hex.size(); i++)
+    {
+        unsigned int nibble = (i % 2 == 0) ? (hash[i / 2] >> 4) : (hash[i / 2] & 0xf);
+        if (hex[i] >= 'a' && nibble >= 8)
+            hex[i] -= 'a' - 'A';
+    }
+    return "0x" + hex;
+}
+
+// Made once, on first use. Recovery never changes a context, so every thread can share this one.
+const secp256k1_context *secp256k1Context()
+{
+    static secp256k1_context *context = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+    return context;
+}
+
+optional<string> signedMsgToAddress(string message, string sig, string *error)
+{
+    optional<string> maybeSigBytes = hexToBytes(sig);
+    if (!maybeSigBytes)
+    {
+        *error = "signature isn't hex";
+        return {};
+    }
+    if (maybeSigBytes->size() != 65)
+    {
+        *error = "signature has to be 65 bytes, not " + to_string(maybeSigBytes->size());
         return {};
     }
+    const unsigned char *sigBytes = (const unsigned char *)maybeSigBytes->data();
 
-    PyObject* function = PyObject_GetAttrString(module,(char*)"signed_msg_to_address");
-    if (!function)
+    unsigned char v = sigBytes[64];
+    int recoveryId;
+    if (v == 0 || v == 1)
+        recoveryId = v;
+    else if (v == 27 || v == 28)
+        recoveryId = v - 27;
+    else if (v >= 35)
+        recoveryId = (v - 35) % 2;
+    else
     {
-        *error = "Python error: error loading functino signed_msg_to_address: " + getPythonErrorText();
+        *error = "bad v: " + to_string(v);
         return {};
     }
 
-    PyObject* result = PyObject_CallFunction(function, "ss", message.c_str(), sig.c_str());
-    if (!result)
+    string prefixedMessage = "\x19" "Ethereum Signed Message:\n" + to_string(message.size()) + message;
+    unsigned char messageHash[32];
+    keccak256((const unsigned char *)prefixedMessage.data(), prefixedMessage.size(), messageHash);
+
+    secp256k1_ecdsa_recoverable_signature recoverableSig;
+    secp256k1_pubkey recoveredKey;
+    if (!secp256k1_ecdsa_recoverable_signature_parse_compact(secp256k1Context(), &recoverableSig, sigBytes, recoveryId) ||
+        !secp256k1_ecdsa_recover(secp256k1Context(), &recoveredKey, &recoverableSig, messageHash))
     {
-        *error = "Python error: error calling function signed_msg_to_address: " + getPythonErrorText();
+        *error = "not a valid signature";
         return {};
     }
 
-    const char* resultCStr = PyUnicode_AsUTF8(result);
-    return {string(resultCStr)};
-}
\ No newline at end of file
+    // uncompressed: 0x04, then x and y
+    unsigned char publicKey[65];
+    size_t publicKeySize = sizeof(publicKey);
+    secp256k1_ec_pubkey_serialize(secp256k1Context(), publicKey, &publicKeySize, &recoveredKey, SECP256K1_EC_UNCOMPRESSED);
+
+    // the address is the last 20 bytes of the hash of the key, without the 0x04
+    unsigned char publicKeyHash[32];
+    keccak256(publicKey + 1, 64, publicKeyHash);
+    return toChecksumAddress(publicKeyHash + 12);
+}
@@ -1,14 +1,17 @@
 #ifndef SIGWRAPPER_H
 #define SIGWRAPPER_H
 
-#define PY_SSIZE_T_CLEAN
-
-#include <Python.h>
 #include <string>
 #include <optional>
 
 using namespace std;
 
+// What py/signed_msg_to_address.py gets out of web3's recover_message: the EIP-55 checksummed address whose key
+// signed message, EIP-191 style ("\x19Ethereum Signed Message:\n" + length + message). sig is hex, 0x optional:
+// r, s, then v (27 or 28; 0, 1 and EIP-155 style values are taken too). Safe to call from any thread.
 optional<string> signedMsgToAddress(string message, string sig, string *error);
 
-#endif // SIGWARPPER_H
\ No newline at end of file
+// Keccak-256, as Ethereum uses it (the original padding, not SHA3-256's)
+void keccak256(const unsigned char *data, size_t size, unsigned char *hash);
+
+#endif // SIGWRAPPER_H
@@ -0,0 +1,87 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+// Unbounded lock-free queue for one producer thread and one consumer. Values go into blocks of BLOCK_SIZE, and a
+// push only allocates when it starts a new block, so there's about one allocation per BLOCK_SIZE values rather
+// than one per value. Neither side ever waits on the other: a producer that's way ahead just has more blocks
+// queued.
+template<typename T, size_t BLOCK_SIZE = 64> class SpscQueue
+{
+    struct Block
+    {
+        std::atomic<size_t> written; // how many slots the producer's filled, and handed over
+        std::atomic<Block *> next;   // set by the producer once it's filled this one
+        size_t read;                 // consumer only
+        std::optional<T> slots[BLOCK_SIZE];
+
+        Block() : written(0), next(nullptr), read(0) {}
+    };
+
+    Block *head; // consumer only; the block it's reading from
+    Block *tail; // producer only; the block it's writing to
+
+public:
+    SpscQueue()
+    {
+        head = tail = new Block;
+    }
+    ~SpscQueue()
+    {
+        while (head)
+        {
+            Block *next = head->next.load();
+            delete head;
+            head = next;
+        }
+    }
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // producer thread only
+    void push(T value)
+    {
+        size_t written = tail->written.load(std::memory_order_relaxed);
+        if (written == BLOCK_SIZE)
+        {
+            // the consumer can let go of the full block once it's seen this, so we don't touch it again
+            Block *block = new Block;
+            tail->next.store(block, std::memory_order_release);
+            tail = block;
+            written = 0;
+        }
+
+        tail->slots[written] = std::move(value);
+        tail->written.store(written + 1, std::memory_order_release);
+    }
+
+    // consumer thread only. Returns false if there's nothing (yet) to pop.
+    bool pop(T *dest)
+    {
+        while (true)
+        {
+            size_t written = head->written.load(std::memory_order_acquire);
+            if (head->read < written)
+            {
+                *dest = std::move(*head->slots[head->read]);
+                head->slots[head->read].reset();
+                head->read++;
+                return true;
+            }
+            if (written < BLOCK_SIZE)
+                return false;
+
+            Block *next = head->next.load(std::memory_order_acquire);
+            if (!next)
+                return false;
+
+            delete head;
+            head = next;
+        }
+    }
+};
+
+#endif // SPSCQUEUE_H
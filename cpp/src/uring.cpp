@@ -0,0 +1,300 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+using namespace std;
+
+int ioUringSetup(unsigned entries, io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+int ioUringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+int ioUringRegister(int ringFd, unsigned opcode, void *arg, unsigned numArgs)
+{
+    return syscall(__NR_io_uring_register, ringFd, opcode, arg, numArgs);
+}
+
+// The kernel reads and writes the ring indices concurrently with us.
+unsigned loadAcquire(const unsigned *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+void storeRelease(unsigned *p, unsigned val)
+{
+    __atomic_store_n(p, val, __ATOMIC_RELEASE);
+}
+
+void *mapRing(int ringFd, size_t size, off_t offset)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, offset);
+    if (p == MAP_FAILED)
+        throw runtime_error(string("io_uring mmap failed: ") + strerror(errno));
+    return p;
+}
+
+IoUring::IoUring(boost::asio::io_service &ioService, unsigned entries, unsigned numRecvBuffers, size_t recvBufferSize)
+    : numUnsubmitted(0), submitHolds(0), numRecvBuffers(numRecvBuffers), recvBufferSize(recvBufferSize), recvBufferRingTail(0),
+      completionEvents(ioService)
+{
+    if (numRecvBuffers == 0 || (numRecvBuffers & (numRecvBuffers - 1)) != 0 || numRecvBuffers > 32768)
+        throw runtime_error("io_uring: numRecvBuffers has to be a power of 2, up to 32768");
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // every connection's multishot recv can complete many times per submission
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    ringFd = ioUringSetup(entries, &params);
+    if (ringFd < 0)
+        throw runtime_error(string("io_uring_setup failed: ") + strerror(errno));
+    if (!(params.features & IORING_FEAT_NODROP))
+    {
+        close(ringFd);
+        throw runtime_error("io_uring: kernel too old (no IORING_FEAT_NODROP)");
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+    sqRing = mapRing(ringFd, sqRingSize, IORING_OFF_SQ_RING);
+    cqRing = mapRing(ringFd, cqRingSize, IORING_OFF_CQ_RING);
+    sqes = (io_uring_sqe *)mapRing(ringFd, sqesSize, IORING_OFF_SQES);
+
+    unsigned char *sq = (unsigned char *)sqRing;
+    sqHead = (unsigned *)(sq + params.sq_off.head);
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+    sqEntries = params.sq_entries;
+
+    unsigned char *cq = (unsigned char *)cqRing;
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // the receive buffers, and the ring that hands them to the kernel
+    recvBufferMemory = (unsigned char *)mmap(NULL, numRecvBuffers * recvBufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    recvBufferRing = (io_uring_buf_ring *)mmap(NULL, numRecvBuffers * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (recvBufferMemory == MAP_FAILED || recvBufferRing == MAP_FAILED)
+        throw runtime_error("io_uring: couldn't map receive buffers");
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)recvBufferRing;
+    reg.ring_entries = numRecvBuffers;
+    reg.bgid = 0;
+    if (ioUringRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        throw runtime_error(string("io_uring: couldn't register receive buffers: ") + strerror(errno));
+
+    for (unsigned i = 0; i < numRecvBuffers; i++)
+    {
+        recycleRecvBuffer(i);
+    }
+
+    // the kernel bumps this for every completion
+    completionEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (completionEventFd < 0 || ioUringRegister(ringFd, IORING_REGISTER_EVENTFD, &completionEventFd, 1) < 0)
+        throw runtime_error(string("io_uring: couldn't register completion eventfd: ") + strerror(errno));
+    completionEvents.assign(completionEventFd);
+
+    waitForCompletions();
+}
+
+IoUring::~IoUring()
+{
+    // Anything still in flight is abandoned, Ops and all.
+    completionEvents.close();
+
+    munmap(recvBufferRing, numRecvBuffers * sizeof(io_uring_buf));
+    munmap(recvBufferMemory, numRecvBuffers * recvBufferSize);
+    munmap(sqes, sqesSize);
+    munmap(cqRing, cqRingSize);
+    munmap(sqRing, sqRingSize);
+    close(ringFd);
+}
+
+io_uring_sqe *IoUring::getSqeLocked()
+{
+    unsigned tail = *sqTail;
+    if (tail - loadAcquire(sqHead) >= sqEntries)
+    {
+        // full; the kernel copies out whatever it's given, so submitting makes room
+        submitLocked();
+        while (tail - loadAcquire(sqHead) >= sqEntries)
+        {
+            this_thread::yield();
+            submitLocked();
+        }
+    }
+
+    unsigned index = tail & *sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    return sqe;
+}
+
+void IoUring::queueSqeLocked()
+{
+    storeRelease(sqTail, *sqTail + 1);
+    numUnsubmitted++;
+}
+
+void IoUring::submitLocked()
+{
+    while (numUnsubmitted > 0)
+    {
+        int submitted = ioUringEnter(ringFd, numUnsubmitted, 0, 0);
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // EBUSY / EAGAIN: the completion side's behind; it'll go with the next submit
+            if (errno != EBUSY && errno != EAGAIN)
+                cout << "io_uring_enter failed: " << strerror(errno) << endl;
+            return;
+        }
+        numUnsubmitted -= submitted;
+    }
+}
+
+// Only one of these reads is ever outstanding, so only one thread at a time reaps. The read's tried right away,
+// so completions that came in since the eventfd was last read aren't missed.
+void IoUring::waitForCompletions()
+{
+    completionEvents.async_read_some(boost::asio::buffer(&completionEventCount, sizeof(completionEventCount)),
+                                     boost::bind(&IoUring::reapCompletions, this, boost::asio::placeholders::error));
+}
+
+void IoUring::reapCompletions(const boost::system::error_code &error)
+{
+    if (error == boost::asio::error::operation_aborted)
+        return;
+    if (error)
+    {
+        cout << "io_uring: error waiting for completions: " << error.message() << endl;
+        return;
+    }
+
+    unsigned head = *cqHead;
+    unsigned tail = loadAcquire(cqTail);
+    for (; head != tail; head++)
+    {
+        io_uring_cqe *cqe = &cqes[head & *cqMask];
+        Op *op = (Op *)cqe->user_data;
+
+        op->handler(cqe->res, cqe->flags);
+
+        if (!(op->multishot && (cqe->flags & IORING_CQE_F_MORE)))
+            delete op;
+    }
+    storeRelease(cqHead, head);
+
+    waitForCompletions();
+}
+
+void IoUring::sendmsg(int fd, const vector<boost::asio::const_buffer> &buffers, CompletionHandler handler)
+{
+    Op *op = new Op;
+    op->handler = handler;
+    op->multishot = false;
+
+    op->iovecs.resize(buffers.size());
+    for (unsigned i = 0; i < buffers.size(); i++)
+    {
+        op->iovecs[i].iov_base = const_cast<void *>(buffers[i].data());
+        op->iovecs[i].iov_len = buffers[i].size();
+    }
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iovecs.data();
+    op->msg.msg_iovlen = op->iovecs.size();
+
+    lock_guard<mutex> lock(sqMutex);
+    io_uring_sqe *sqe = getSqeLocked();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)&op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)op;
+    queueSqeLocked();
+
+    if (submitHolds == 0)
+        submitLocked();
+}
+
+void IoUring::recvMultishot(int fd, CompletionHandler handler)
+{
+    Op *op = new Op;
+    op->handler = handler;
+    op->multishot = true;
+
+    lock_guard<mutex> lock(sqMutex);
+    io_uring_sqe *sqe = getSqeLocked();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uint64_t)op;
+    queueSqeLocked();
+
+    if (submitHolds == 0)
+        submitLocked();
+}
+
+const unsigned char *IoUring::recvBuffer(uint16_t bufferId)
+{
+    return recvBufferMemory + bufferId * recvBufferSize;
+}
+
+void IoUring::recycleRecvBuffer(uint16_t bufferId)
+{
+    lock_guard<mutex> lock(recvBufferMutex);
+
+    // Not recvBufferRing->bufs or ->tail: compiled as C++, the header's flexible array member ends up 8 bytes
+    // in. The ring's just an array of io_uring_buf, with the tail in the first one's resv.
+    io_uring_buf *bufs = (io_uring_buf *)recvBufferRing;
+
+    io_uring_buf *buf = &bufs[recvBufferRingTail & (numRecvBuffers - 1)];
+    buf->addr = (uint64_t)(recvBufferMemory + bufferId * recvBufferSize);
+    buf->len = recvBufferSize;
+    buf->bid = bufferId;
+
+    recvBufferRingTail++;
+    __atomic_store_n(&bufs[0].resv, recvBufferRingTail, __ATOMIC_RELEASE);
+}
+
+boost::shared_ptr<void> IoUring::holdSubmits()
+{
+    submitHolds++;
+    return boost::shared_ptr<void>(static_cast<void *>(this), [this](void *)
+    {
+        if (--submitHolds == 0)
+            submit();
+    });
+}
+
+void IoUring::submit()
+{
+    lock_guard<mutex> lock(sqMutex);
+    submitLocked();
+}
+
+#endif // HAVE_IO_URING
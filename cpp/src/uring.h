@@ -0,0 +1,106 @@
+#ifndef URING_H
+#define URING_H
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <linux/io_uring.h>
+
+// An io_uring the server can do its steady-state socket I/O through instead of asio (see "--io-uring" in
+// server.cpp). Straight syscalls, no liburing.
+//
+// Receives are multishot, into a ring of buffers registered with the kernel up front: one submission per
+// connection, and the kernel picks a free buffer for each chunk of data. Sends are gather sendmsgs straight
+// out of the (shared) packet buffers.
+//
+// Anything can be queued from any thread. It's submitted right away unless something's holding submits
+// (holdSubmits), in which case it all goes in one io_uring_enter once the last hold's let go; the server holds
+// them while it fans a tick's frames out, so that's one syscall per tick however many clients there are.
+//
+// Completions are reaped on the io_service's threads (the kernel signals an eventfd the io_service is reading),
+// one batch at a time. Handlers are called from there, so they should be quick: post to a strand, say.
+class IoUring
+{
+public:
+    // result is what the syscall would've returned, or -errno
+    typedef boost::function<void(int result, uint32_t flags)> CompletionHandler;
+
+private:
+    struct Op
+    {
+        CompletionHandler handler;
+        bool multishot;
+        msghdr msg; // sendmsg only
+        std::vector<iovec> iovecs;
+    };
+
+    int ringFd;
+
+    void *sqRing;
+    size_t sqRingSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned sqEntries;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned numUnsubmitted;
+    std::mutex sqMutex;
+    std::atomic<int> submitHolds;
+
+    void *cqRing;
+    size_t cqRingSize;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+
+    io_uring_buf_ring *recvBufferRing;
+    unsigned char *recvBufferMemory;
+    unsigned numRecvBuffers;
+    size_t recvBufferSize;
+    uint16_t recvBufferRingTail;
+    std::mutex recvBufferMutex;
+
+    int completionEventFd;
+    boost::asio::posix::stream_descriptor completionEvents;
+    uint64_t completionEventCount;
+
+    io_uring_sqe *getSqeLocked();
+    void queueSqeLocked();
+    void submitLocked();
+    void waitForCompletions();
+    void reapCompletions(const boost::system::error_code &error);
+
+public:
+    // Throws runtime_error if the kernel won't give us a ring. numRecvBuffers has to be a power of 2.
+    // Destroy it only once ioService has stopped.
+    IoUring(boost::asio::io_service &ioService, unsigned entries, unsigned numRecvBuffers, size_t recvBufferSize);
+    ~IoUring();
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    // The buffers have to stay valid until the handler's called. It may send less than all of them.
+    void sendmsg(int fd, const std::vector<boost::asio::const_buffer> &buffers, CompletionHandler handler);
+
+    // The handler's called for every chunk of data, with IORING_CQE_F_MORE set in flags if there's more to
+    // come. Data's in recvBuffer(flags >> IORING_CQE_BUFFER_SHIFT), which has to be handed back with
+    // recycleRecvBuffer once it's been copied out. -ENOBUFS means they were all in use; arm it again.
+    void recvMultishot(int fd, CompletionHandler handler);
+    const unsigned char *recvBuffer(uint16_t bufferId);
+    void recycleRecvBuffer(uint16_t bufferId);
+
+    // Submits are held until every copy of the returned pointer's gone.
+    boost::shared_ptr<void> holdSubmits();
+    void submit();
+};
+
+#endif // HAVE_IO_URING
+
+#endif // URING_H
@@ -2,8 +2,6 @@
 #define PACK_H
 
 #include <stdio.h>
-#include <ctype.h>
-#include <stdarg.h>
 #include <string.h>
 #include <string>
 #include <assert.h>
@@ -17,32 +15,6 @@
 #define unpack754_32(i) (unpack754((i), 32, 8))
 #define unpack754_64(i) (unpack754((i), 64, 11))
 
-const unsigned int PACK_B_SIZE = 1;
-const unsigned int PACK_C_SIZE = 1;
-const unsigned int PACK_H_SIZE = 2;
-const unsigned int PACK_L_SIZE = 4;
-const unsigned int PACK_Q_SIZE = 8;
-
-const unsigned char PACK_UC_MIN = 0;
-const unsigned char PACK_UC_MAX = 255;
-const char PACK_SC_MIN = -127;
-const char PACK_SC_MAX = 127;
-
-const unsigned short PACK_UH_MIN = 0;
-const unsigned short PACK_UH_MAX = 65535;
-const short PACK_SH_MIN = -32768;
-const short PACK_SH_MAX = 32767;
-
-const unsigned long PACK_UL_MIN = 0;
-const unsigned long PACK_UL_MAX = 4294967295;
-const long PACK_SL_MIN = -2147483648;
-const long PACK_SL_MAX = 2147483647;
-
-const unsigned long long PACK_UQ_MIN = 0;
-const unsigned long long PACK_UQ_MAX = 18446744073709551615u;
-const long long PACK_SQ_MIN = -9223372036854775807;
-const long long PACK_SQ_MAX = 9223372036854775806;
-
 /*
 ** pack754() -- pack a floating point number into IEEE-754 format
 */
@@ -98,36 +70,4 @@ long long int unpacki64(unsigned char *buf);
 */
 unsigned long long int unpacku64(unsigned char *buf);
 
-/*
-** pack() -- store data dictated by the format string in the buffer
-**
-**   bits |signed   unsigned   float   string
-**   -----+----------------------------------
-**      8 |   c        C         
-**     16 |   h        H         f
-**     32 |   l        L         d
-**     64 |   q        Q         g
-**      - |                               s
-**
-**  (16-bit unsigned length is automatically prepended to strings)
-*/
-
-void packToVch(std::vector<unsigned char> *vch, const char *format, ...);
-
-/*
-** unpack() -- unpack data dictated by the format string into the buffer
-**
-**   bits |signed   unsigned   float   string
-**   -----+----------------------------------
-**      8 |   c        C         
-**     16 |   h        H         f
-**     32 |   l        L         d
-**     64 |   q        Q         g
-**      - |                               s
-**
-**  (string is extracted based on its stored length, but 's' can be
-**  prepended with a max length)
-*/
-std::vector<unsigned char>::iterator unpackFromIter(std::vector<unsigned char>::iterator iter, const char *format, ...);
-
 #endif
@@ -0,0 +1,315 @@
+#ifndef VCHSTREAM_H
+#define VCHSTREAM_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include "vchpack.h"
+
+// Typed writer/reader for the wire format. Field widths come from the template argument instead of a
+// runtime format string, so everything resolves at compile time. Integers are big-endian and half
+// floats and strings are laid out exactly as packToVch used to ("f" and "s"), so the bytes are unchanged.
+//
+// Varints are LEB128: 7 bits per byte, low bits first, high bit set on all but the last byte.
+// Signed varints are zigzagged first so small negative numbers stay small.
+
+class VchWriter
+{
+    std::vector<unsigned char> *dest;
+
+    unsigned char *extend(size_t numBytes)
+    {
+        size_t oldSize = dest->size();
+        dest->resize(oldSize + numBytes);
+        return dest->data() + oldSize;
+    }
+
+public:
+    VchWriter(std::vector<unsigned char> *dest) : dest(dest) {}
+
+    // Worth calling up front when the caller knows roughly how much is coming.
+    void reserve(size_t numBytes)
+    {
+        dest->reserve(dest->size() + numBytes);
+    }
+
+    template<typename T> void put(T val)
+    {
+        static_assert(std::is_integral<T>::value, "VchWriter::put only takes integers");
+
+        if constexpr (std::is_same<T, bool>::value)
+        {
+            dest->push_back(val ? 1 : 0);
+        }
+        else
+        {
+            using UnsignedT = typename std::make_unsigned<T>::type;
+            UnsignedT bits = static_cast<UnsignedT>(val);
+
+            unsigned char *out = extend(sizeof(T));
+            for (size_t i = 0; i < sizeof(T); i++)
+            {
+                out[i] = (unsigned char)(bits >> (8 * (sizeof(T) - 1 - i)));
+            }
+        }
+    }
+
+    void putVarint(uint64_t val)
+    {
+        while (val >= 0x80)
+        {
+            dest->push_back((unsigned char)(val | 0x80));
+            val >>= 7;
+        }
+        dest->push_back((unsigned char)val);
+    }
+
+    void putSignedVarint(int64_t val)
+    {
+        putVarint(((uint64_t)val << 1) ^ (uint64_t)(val >> 63));
+    }
+
+    void putHalfFloat(float f)
+    {
+        put<uint16_t>(pack754_16(f));
+    }
+
+    // lossless: the float's own bits, big-endian
+    void putFloat(float f)
+    {
+        static_assert(sizeof(float) == sizeof(uint32_t), "putFloat assumes a 32-bit float");
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        put<uint32_t>(bits);
+    }
+
+    // u16 length, then the bytes
+    void putString(const std::string &s)
+    {
+        put<uint16_t>(s.size());
+        dest->insert(dest->end(), s.begin(), s.end());
+    }
+
+    void putBytes(const std::vector<unsigned char> &bytes)
+    {
+        dest->insert(dest->end(), bytes.begin(), bytes.end());
+    }
+};
+
+// Reads over a (pointer, length) span it doesn't own; the buffer has to outlive the reader and
+// anything it hands back (getString, getBytes point into it).
+//
+// Every read is bounds-checked. Malformed input never throws or reads out of bounds: the reader
+// records an error, reads return zeroes from then on, and the caller checks ok() once the whole
+// message is decoded and drops the message if it isn't.
+class VchReader
+{
+public:
+    enum Error {
+        NoError,
+        Truncated,       // ran off the end of the data
+        ValueTooBig,     // a varint or count doesn't fit the field it's going into
+        StringTooLong,
+        UnknownTypechar,
+        BadEncoding      // any other structural problem; see the call site that flagged it
+    };
+
+private:
+    const unsigned char *pos;
+    const unsigned char *end;
+    Error error;
+
+    bool have(size_t numBytes)
+    {
+        if (error != NoError)
+            return false;
+        if ((size_t)(end - pos) < numBytes)
+        {
+            fail(Truncated);
+            return false;
+        }
+        return true;
+    }
+
+public:
+    VchReader(const unsigned char *data, size_t len) : pos(data), end(data + len), error(NoError) {}
+    VchReader(const std::vector<unsigned char> &v) : VchReader(v.data(), v.size()) {}
+
+    bool ok() const { return error == NoError; }
+    Error getError() const { return error; }
+    bool atEnd() const { return pos == end; }
+    size_t remaining() const { return end - pos; }
+
+    // keeps the first error; skips to the end so nothing else gets read
+    void fail(Error e)
+    {
+        if (error == NoError)
+            error = e;
+        pos = end;
+    }
+
+    const char *getErrorString() const
+    {
+        switch (error)
+        {
+        case NoError: return "no error";
+        case Truncated: return "truncated";
+        case ValueTooBig: return "value too big for its field";
+        case StringTooLong: return "string too long";
+        case UnknownTypechar: return "unknown typechar";
+        case BadEncoding: return "bad encoding";
+        }
+        return "unknown error";
+    }
+
+    // next byte without consuming it; 0 if there isn't one
+    unsigned char peek()
+    {
+        if (!have(1))
+            return 0;
+        return *pos;
+    }
+
+    template<typename T> T get()
+    {
+        static_assert(std::is_integral<T>::value, "VchReader::get only returns integers");
+
+        if (!have(sizeof(T)))
+            return 0;
+
+        if constexpr (std::is_same<T, bool>::value)
+        {
+            return *(pos++) != 0;
+        }
+        else
+        {
+            using UnsignedT = typename std::make_unsigned<T>::type;
+            UnsignedT bits = 0;
+
+            for (size_t i = 0; i < sizeof(T); i++)
+            {
+                bits = (UnsignedT)((bits << 8) | pos[i]);
+            }
+            pos += sizeof(T);
+
+            return static_cast<T>(bits);
+        }
+    }
+
+    template<typename T = uint64_t> T getVarint()
+    {
+        static_assert(std::is_unsigned<T>::value, "VchReader::getVarint returns unsigned integers; use getSignedVarint");
+
+        uint64_t val = 0;
+        for (unsigned int shift = 0; ; shift += 7)
+        {
+            if (shift >= 64)
+            {
+                fail(ValueTooBig);
+                return 0;
+            }
+            if (!have(1))
+                return 0;
+
+            unsigned char byte = *(pos++);
+            val |= (uint64_t)(byte & 0x7f) << shift;
+
+            if (!(byte & 0x80))
+                break;
+        }
+
+        if (val > std::numeric_limits<T>::max())
+        {
+            fail(ValueTooBig);
+            return 0;
+        }
+
+        return static_cast<T>(val);
+    }
+
+    template<typename T = int64_t> T getSignedVarint()
+    {
+        uint64_t zigzagged = getVarint<uint64_t>();
+        int64_t val = (int64_t)(zigzagged >> 1) ^ -(int64_t)(zigzagged & 1);
+
+        if (val < std::numeric_limits<T>::min() || val > std::numeric_limits<T>::max())
+        {
+            fail(ValueTooBig);
+            return 0;
+        }
+
+        return static_cast<T>(val);
+    }
+
+    // A count of things that each take at least one byte, so it can't be more than what's left.
+    // Keeps a corrupt count from driving a huge loop or allocation.
+    uint32_t getCount()
+    {
+        uint32_t count = getVarint<uint32_t>();
+        if (count > remaining())
+        {
+            fail(Truncated);
+            return 0;
+        }
+        return count;
+    }
+
+    // an enum packed as a u8; anything past lastValue is an error
+    template<typename E> E getEnum(E lastValue)
+    {
+        uint8_t val = get<uint8_t>();
+        if (val > lastValue)
+        {
+            fail(BadEncoding);
+            return static_cast<E>(0);
+        }
+        return static_cast<E>(val);
+    }
+
+    float getHalfFloat()
+    {
+        return unpack754_16(get<uint16_t>());
+    }
+
+    float getFloat()
+    {
+        uint32_t bits = get<uint32_t>();
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    // u16 length, then the bytes. Points into the buffer; copy it if it needs to outlive it.
+    // A maxSize of 0 means no limit.
+    std::string_view getString(uint16_t maxSize = 0)
+    {
+        uint16_t len = get<uint16_t>();
+        if (maxSize > 0 && len > maxSize)
+        {
+            fail(StringTooLong);
+            return std::string_view();
+        }
+        if (!have(len))
+            return std::string_view();
+
+        std::string_view s((const char *)pos, len);
+        pos += len;
+        return s;
+    }
+
+    // null if there aren't numBytes left
+    const unsigned char *getBytes(size_t numBytes)
+    {
+        if (!have(numBytes))
+            return NULL;
+
+        const unsigned char *bytes = pos;
+        pos += numBytes;
+        return bytes;
+    }
+};
+
+#endif // VCHSTREAM_H